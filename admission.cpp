@@ -0,0 +1,211 @@
+// admission.cpp
+// Admission control for new sessions, see admission.h
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sock_diag.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "siphash.h"
+#include "log.h"
+extern "C" {
+#include "calcLib.h"
+}
+
+AdmissionConfig AdmissionConfig::per_worker(int n) const {
+    AdmissionConfig c = *this;
+    if (n > 1) {
+        if (c.udp_budget) c.udp_budget = (c.udp_budget + n - 1) / n;
+    }
+    return c;
+}
+
+bool parse_hello_rate(const char *arg, AdmissionConfig &cfg) {
+    char *end;
+    cfg.hello_rate = strtod(arg, &end);
+    cfg.hello_burst = 0;
+    if (*end == '/') cfg.hello_burst = strtod(end + 1, &end);
+    return end != arg && *end == '\0' && cfg.hello_rate >= 0 && cfg.hello_burst >= 0;
+}
+
+bool parse_bytes(const char *arg, size_t &out) {
+    char *end;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (end == arg) return false;
+    switch (*end) {
+    case 'K': case 'k': v <<= 10; ++end; break;
+    case 'M': case 'm': v <<= 20; ++end; break;
+    case 'G': case 'g': v <<= 30; ++end; break;
+    default: break;
+    }
+    out = (size_t)v;
+    return *end == '\0';
+}
+
+SourceLimiter::SourceLimiter(size_t slots, double rate, double burst)
+    : set_mask(0), rate_per_ms(rate / 1000.0), burst(burst) {
+    if (slots == 0) return;
+    size_t sets = 1;
+    while (sets * WAYS < slots) sets <<= 1;
+    table.assign(sets * WAYS, Bucket());
+    set_mask = sets - 1;
+    // Keyed, so sources cannot be picked to crowd one set.
+    for (int i = 0; i < 2; ++i) {
+        uint64_t r = calcRngNext(calcRngThread());
+        memcpy(hash_key + 8 * i, &r, 8);
+    }
+}
+
+bool SourceLimiter::allow(const ClientAddr &peer, int64_t now) {
+    // IPv4 (mapped) by address, IPv6 by /64: a host usually has a whole
+    // /64 to rotate through.
+    static const uint8_t v4_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    size_t len = memcmp(peer.addr, v4_prefix, sizeof(v4_prefix)) == 0 ? 16 : 8;
+    uint64_t h = siphash24(hash_key, peer.addr, len);
+    uint64_t key = h | 1;
+
+    Bucket *set = &table[((h >> 32) & set_mask) * WAYS];
+    Bucket *b = NULL, *idlest = &set[0];
+    for (size_t i = 0; i < WAYS; ++i) {
+        if (set[i].key == key) { b = &set[i]; break; }
+        if (set[i].last < idlest->last) idlest = &set[i];
+    }
+    if (!b) {
+        b = idlest;
+        b->key = key;
+        b->last = now;
+        b->tokens = burst;
+    } else if (now > b->last) {
+        b->tokens += (now - b->last) * rate_per_ms;
+        if (b->tokens > burst) b->tokens = burst;
+        b->last = now;
+    }
+    if (b->tokens < 1.0) return false;
+    b->tokens -= 1.0;
+    return true;
+}
+
+SessionCap *SessionCap::create(long max, int slots) {
+    if (slots < 1 || slots > MAX_SLOTS) {
+        fprintf(stderr, "session cap: %d workers, at most %d\n", slots, MAX_SLOTS);
+        return NULL;
+    }
+    // Fresh anonymous memory is zero: every slot starts with no sessions.
+    void *p = mmap(NULL, sizeof(SessionCap), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap(session cap)");
+        return NULL;
+    }
+    SessionCap *cap = (SessionCap*)p;
+    cap->max = max;
+    cap->slots = slots;
+    return cap;
+}
+
+// Count first, then look: of two workers racing for the last session at
+// least one sees the other's count, so the sum never passes max.
+bool SessionCap::acquire(int slot) {
+    count[slot].open.fetch_add(1);
+    long total = 0;
+    for (int i = 0; i < slots; ++i) total += count[i].open.load();
+    if (total <= max) return true;
+    count[slot].open.fetch_sub(1);
+    return false;
+}
+
+static const size_t LIMITER_SLOTS = 16384;
+
+static double burst_of(const AdmissionConfig &cfg) {
+    if (cfg.hello_burst > 0) return cfg.hello_burst;
+    return cfg.hello_rate > 1 ? cfg.hello_rate : 1;
+}
+
+Admission::Admission(const AdmissionConfig &cfg)
+    : cfg(cfg), limiter(cfg.hello_rate > 0 ? LIMITER_SLOTS : 0, cfg.hello_rate, burst_of(cfg)),
+      cap(NULL), cap_slot(0), level(0), interval_start(0), worst_round(0), rng(calcRngNext(calcRngThread()) | 1) {}
+
+void Admission::watch_listener(int fd) { listeners.push_back(fd); }
+void Admission::watch_datagram(int fd) { datagrams.push_back(fd); }
+
+// Draw against the shed level; xorshift, one per new session.
+bool Admission::shed() {
+    if (level == 0) return false;
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (int)(rng % SHED_LEVELS) < level;
+}
+
+bool Admission::admit_tcp(const struct sockaddr_storage &peer, int64_t now) {
+    metrics::Reject why;
+    if (cap && !cap->acquire(cap_slot)) {
+        metrics::rejected(metrics::TCP, metrics::REJECT_CAP);
+        return false;
+    }
+    if (shed()) why = metrics::REJECT_SHED;
+    else if (cfg.hello_rate > 0 && !limiter.allow(client_addr(peer), now)) why = metrics::REJECT_RATE;
+    else return true;
+    tcp_closed();
+    metrics::rejected(metrics::TCP, why);
+    return false;
+}
+
+bool Admission::admit_udp(size_t state_bytes, const ClientAddr &peer, int64_t now) {
+    metrics::Reject why;
+    if (cfg.udp_budget && state_bytes > cfg.udp_budget) why = metrics::REJECT_MEMORY;
+    else if (shed()) why = metrics::REJECT_SHED;
+    else if (cfg.hello_rate > 0 && !limiter.allow(peer, now)) why = metrics::REJECT_RATE;
+    else return true;
+    metrics::rejected(metrics::UDP, why);
+    return false;
+}
+
+// The fullest watched queue, 0..1.
+double Admission::queue_fill() const {
+    double fill = 0;
+    for (int fd : listeners) {
+        // On a listener, unacked is the accept queue and sacked its limit.
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && ti.tcpi_sacked > 0) {
+            double f = (double)ti.tcpi_unacked / ti.tcpi_sacked;
+            if (f > fill) fill = f;
+        }
+    }
+    for (int fd : datagrams) {
+        uint32_t mem[SK_MEMINFO_VARS];
+        socklen_t len = sizeof(mem);
+        if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0 && mem[SK_MEMINFO_RCVBUF] > 0) {
+            double f = (double)mem[SK_MEMINFO_RMEM_ALLOC] / mem[SK_MEMINFO_RCVBUF];
+            if (f > fill) fill = f;
+        }
+    }
+    return fill;
+}
+
+void Admission::update(int64_t now) {
+    double fill = queue_fill();
+    int was = level;
+    if (worst_round > cfg.lag_ms || fill > 0.5) {
+        level = level + 2 < SHED_LEVELS ? level + 2 : SHED_LEVELS - 1;
+    } else {
+        // A loop that slept through several intervals was calm in all.
+        int64_t calm = interval_start ? (now - interval_start) / SHED_INTERVAL_MS : SHED_LEVELS;
+        level = calm >= level ? 0 : level - (int)calm;
+    }
+    if (was == 0 && level > 0) {
+        LOG_WARN("overload: shedding new sessions (round {} ms, queue {}% full)", worst_round, (int64_t)(fill * 100));
+        metrics::shedding(true);
+    } else if (was > 0 && level == 0) {
+        LOG_WARN("overload over, admitting all new sessions");
+        metrics::shedding(false);
+    }
+    worst_round = 0;
+    interval_start = now;
+}
@@ -0,0 +1,167 @@
+// admission.h
+// Admission control: whether a new session may start. Sessions already
+// admitted are never refused; under overload the servers turn new ones
+// away early and cheaply, so admitted clients keep normal latency.
+// Checked in order, cheapest first:
+//   cap     TCP: sessions open over all workers at max_sessions
+//           (SessionCap).
+//   memory  UDP: one more client would take the client table and expiry
+//           queue past udp_budget bytes.
+//   shed    the worker is overloaded and sheds a share of new sessions
+//           at random (below).
+//   rate    the source's token bucket is empty: hello_rate new sessions
+//           per second per source address, bursts of hello_burst. IPv6
+//           sources are bucketed per /64.
+// A refused TCP connection gets "ERROR BUSY\n" and is closed; a refused
+// UDP hello is dropped without a reply, so a spoofed flood is not
+// reflected. Each refusal is counted in metrics.h.
+//
+// Shedding: when lag_ms is set the worker checks itself every
+// SHED_INTERVAL_MS. It counts as overloaded if an event loop round took
+// longer than lag_ms or a watched socket queue (a listener's accept
+// queue, a UDP socket's receive buffer) was more than half full. Each
+// overloaded interval raises the shed level by two sixteenths of new
+// sessions, up to fifteen; each calm one lowers it by one.
+//
+// One Admission per worker loop, used from that thread only. The session
+// cap is shared by all workers through one SessionCap; the other limits
+// are per worker: the mains divide the budget they are given among their
+// workers (per_worker()), the hello rate applies to each worker as it is.
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "clienttable.h"
+#include "metrics.h"
+
+struct AdmissionConfig {
+    long max_sessions = 0;   // TCP sessions open at once over all workers, 0 = no cap
+    double hello_rate = 0;   // per source and second, 0 = no limit
+    double hello_burst = 0;  // bucket size, 0 = max(1, hello_rate)
+    size_t udp_budget = 0;   // bytes of UDP client state, 0 = no budget
+    int lag_ms = 0;          // shed when a loop round takes longer, 0 = never shed
+
+    bool enabled() const { return max_sessions || hello_rate > 0 || udp_budget || lag_ms; }
+    // This configuration with the UDP budget split over n workers.
+    AdmissionConfig per_worker(int n) const;
+};
+
+// Command line helpers. "rate[/burst]" for -H, and a byte count with an
+// optional K, M or G suffix for -M.
+bool parse_hello_rate(const char *arg, AdmissionConfig &cfg);
+bool parse_bytes(const char *arg, size_t &out);
+
+// Token buckets for source addresses in a fixed table: four-way set
+// associative, a source that finds its set full takes the slot idle the
+// longest. No allocation after construction, however many sources.
+class SourceLimiter {
+public:
+    static const size_t WAYS = 4;
+
+    SourceLimiter(size_t slots, double rate, double burst);
+
+    // Take a token for peer (port ignored) at monotonic ms now.
+    bool allow(const ClientAddr &peer, int64_t now);
+
+private:
+    struct Bucket {
+        uint64_t key;  // 0 = empty
+        int64_t last;  // ms of the last refill
+        double tokens;
+    };
+
+    std::vector<Bucket> table;
+    size_t set_mask;
+    double rate_per_ms, burst;
+    uint8_t hash_key[16];
+};
+
+// The TCP session cap over all workers, threads or -P processes. Every
+// worker counts its open sessions in its own slot of one MAP_SHARED
+// mapping, made before the workers start; a new session is admitted if
+// the sum of the slots, its own included, stays within max. A worker
+// that dies takes its sessions with it, so its replacement resets the
+// slot instead of inheriting a count nobody will bring down.
+class SessionCap {
+public:
+    static const int MAX_SLOTS = 1024;
+
+    // NULL on failure.
+    static SessionCap *create(long max, int slots);
+
+    bool acquire(int slot);
+    void release(int slot) { count[slot].open.fetch_sub(1); }
+    void reset(int slot) { count[slot].open.store(0); }
+
+    long max;
+    int slots;
+
+private:
+    struct Slot {
+        alignas(64) std::atomic<long> open;
+    };
+    Slot count[MAX_SLOTS];
+};
+
+class Admission {
+public:
+    static const int SHED_LEVELS = 16;
+    static const int64_t SHED_INTERVAL_MS = 100;
+
+    explicit Admission(const AdmissionConfig &cfg);
+
+    // Sample fd's queue when checking for overload.
+    void watch_listener(int fd);
+    void watch_datagram(int fd);
+
+    // Count this worker's TCP sessions in cap's slot. Without it there
+    // is no session cap.
+    void share_cap(SessionCap *cap, int slot) { this->cap = cap; cap_slot = slot; }
+
+    // A new TCP connection from peer. Every admitted one must be matched
+    // by a tcp_closed() when it ends.
+    bool admit_tcp(const struct sockaddr_storage &peer, int64_t now);
+    void tcp_closed() { if (cap) cap->release(cap_slot); }
+    // A new UDP client from peer whose state would bring the worker's
+    // total to state_bytes.
+    bool admit_udp(size_t state_bytes, const ClientAddr &peer, int64_t now);
+
+    // End of an event loop round that spent busy ms working.
+    void round(int64_t busy, int64_t now) {
+        if (!cfg.lag_ms) return;
+        if (busy > worst_round) worst_round = busy;
+        if (now - interval_start >= SHED_INTERVAL_MS) update(now);
+    }
+
+    int shed_level() const { return level; }
+    // A loop's wait timeout, shortened while shedding so the level comes
+    // back down on an idle worker too.
+    int wait_timeout(int timeout_ms) const {
+        if (!level || (timeout_ms >= 0 && timeout_ms <= SHED_INTERVAL_MS)) return timeout_ms;
+        return (int)SHED_INTERVAL_MS;
+    }
+
+    const AdmissionConfig cfg;
+
+private:
+    bool shed();
+    void update(int64_t now);
+    double queue_fill() const;
+
+    SourceLimiter limiter;  // empty without hello_rate
+    SessionCap *cap;
+    int cap_slot;
+    std::vector<int> listeners, datagrams;
+    int level;
+    int64_t interval_start;
+    int64_t worst_round;
+    uint64_t rng;
+};
+
+#endif
@@ -0,0 +1,136 @@
+// assignpool.cpp
+// Refill thread and per-thread pools for assignpool.h.
+
+#include <pthread.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "assignpool.h"
+#include "textproto.h"
+
+static const char *const OP_NAMES[] = { "add", "sub", "mul", "div" };
+static_assert(sizeof(Assignment::text) >= textproto::ASSIGNMENT_LINE_MAX, "assignment line fits");
+
+void make_assignments(calcRng *rng, Assignment *out, size_t n) {
+    // Draw and evaluate in structure-of-arrays chunks, then lay out frames.
+    const size_t CHUNK = 64;
+    uint32_t ops[CHUNK];
+    int32_t v1[CHUNK], v2[CHUNK], expected[CHUNK];
+    for (size_t i = 0; i < n; i += CHUNK) {
+        int m = (int)(n - i < CHUNK ? n - i : CHUNK);
+        calcRandomBatch(rng, m, ops, v1, v2, NULL);
+        calcEvaluateBatch(m, ops, v1, v2, expected);
+        for (int j = 0; j < m; ++j) {
+            Assignment &a = out[i + j];
+            a.arith = ops[j];
+            a.v1 = v1[j];
+            a.v2 = v2[j];
+            a.expected = expected[j];
+            a.text_len = (uint32_t)textproto::format_assignment(a.text, OP_NAMES[a.arith - 1], a.v1, a.v2);
+
+            calcProtocol cp;
+            cp.type = 1;
+            cp.major_version = 1;
+            cp.minor_version = 1;
+            cp.id = 0;
+            cp.arith = a.arith;
+            cp.inValue1 = a.v1;
+            cp.inValue2 = a.v2;
+            cp.inResult = 0;
+            wire::CalcProtocol::encode(a.binary, cp);
+        }
+    }
+}
+
+// One refill thread per process serves every worker's pool. It sleeps on
+// the condition variable until some pool drops below LOW_WATER.
+namespace {
+
+struct Refiller {
+    std::mutex lock;
+    std::condition_variable cv;   // pending was set
+    std::condition_variable idle; // busy was cleared
+    std::vector<AssignPool*> pools;
+    AssignPool *busy = NULL;      // pool being filled, outside the lock
+    bool started = false;
+    bool pending = false;
+
+    void run() {
+        calcRng *rng = calcRngThread();
+        std::unique_lock<std::mutex> g(lock);
+        for (;;) {
+            cv.wait(g, [this] { return pending; });
+            pending = false;
+            // The pool list may change while we fill without the lock, so
+            // walk it by index and go round again if a request was missed.
+            for (size_t i = 0; i < pools.size(); ++i) {
+                AssignPool *p = pools[i];
+                if (!p->wanted.load(std::memory_order_acquire)) continue;
+                p->wanted.store(false, std::memory_order_release);
+                busy = p;
+                g.unlock();
+                p->refill(rng);
+                g.lock();
+                busy = NULL;
+                idle.notify_all();
+            }
+            for (AssignPool *p : pools)
+                if (p->wanted.load(std::memory_order_acquire)) pending = true;
+        }
+    }
+
+    void want(AssignPool *p) {
+        if (p->wanted.exchange(true, std::memory_order_acq_rel)) return;
+        std::lock_guard<std::mutex> g(lock);
+        pending = true;
+        cv.notify_one();
+    }
+
+    void add(AssignPool *p) {
+        std::lock_guard<std::mutex> g(lock);
+        pools.push_back(p);
+        if (!started) {
+            started = true;
+            std::thread(&Refiller::run, this).detach();
+        }
+    }
+
+    void remove(AssignPool *p) {
+        std::unique_lock<std::mutex> g(lock);
+        idle.wait(g, [this, p] { return busy != p; });
+        pools.erase(std::remove(pools.begin(), pools.end(), p), pools.end());
+    }
+};
+
+// Leaked on purpose: the detached refill thread may outlive static
+// destruction at exit.
+Refiller *refiller = new Refiller;
+
+// Registers the thread's pool on first use and unlinks it when the
+// thread exits.
+struct PoolHolder {
+    AssignPool *pool = NULL;
+    ~PoolHolder() {
+        if (!pool) return;
+        refiller->remove(pool);
+        delete pool;
+    }
+};
+
+thread_local PoolHolder holder;
+
+}
+
+void next_assignment(Assignment &a) {
+    AssignPool *p = holder.pool;
+    if (!p) {
+        p = holder.pool = new AssignPool;
+        refiller->add(p);
+        refiller->want(p);
+    }
+    if (!p->take(a)) make_assignments(calcRngThread(), &a, 1);
+    if (p->level() < AssignPool::LOW_WATER) refiller->want(p);
+}
@@ -0,0 +1,99 @@
+// assignpool.h
+// Ready-made assignments. A background thread keeps a ring per worker
+// thread topped up with entries whose operands, expected result and both
+// wire frames are already built, so a session only takes an entry,
+// stamps its id into the binary frame and sends. When a ring runs dry
+// the worker builds the entry itself; it never waits for the refiller.
+
+#ifndef ASSIGNPOOL_H
+#define ASSIGNPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+#include "wirecodec.h"
+
+extern "C" {
+#include "calcLib.h"
+}
+
+struct Assignment {
+    static const size_t TEXT_PREFIX = 12; // strlen("ASSIGNMENT: ")
+    static const size_t BINARY_SIZE = wire::CalcProtocol::SIZE;
+
+    uint32_t arith;
+    int32_t v1, v2;
+    int32_t expected;
+    uint32_t text_len;
+    char text[40];                      // "ASSIGNMENT: add 12 34\n"
+    unsigned char binary[BINARY_SIZE];  // calcProtocol type 1, version 1.1, id 0
+
+    // The bare "add 12 34\n" line the UDP text protocol sends.
+    const char *op_line() const { return text + TEXT_PREFIX; }
+    size_t op_line_len() const { return text_len - TEXT_PREFIX; }
+
+    // Fill in the per-session fields of the binary frame.
+    void stamp(uint32_t id, uint16_t minor = 1) {
+        wire::CalcProtocol::put<&calcProtocol::minor_version>(binary, minor);
+        wire::CalcProtocol::put<&calcProtocol::id>(binary, id);
+    }
+};
+
+// Build n assignments from rng.
+void make_assignments(calcRng *rng, Assignment *out, size_t n);
+
+// Single producer (the refill thread), single consumer (the owning worker
+// thread) ring.
+class AssignPool {
+public:
+    static const size_t SIZE = 1024;
+    static const size_t LOW_WATER = SIZE / 2;
+
+    AssignPool() : wanted(false), head(0), tail(0) {}
+
+    bool take(Assignment &a) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        if (h == t) return false;
+        a = ring[h & (SIZE - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t level() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    // Producer side: top the ring up, returns how many entries were added.
+    size_t refill(calcRng *rng) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        size_t n = SIZE - (t - h);
+        // Free space is at most two runs: up to the end of the array, then
+        // from its start.
+        size_t at = t & (SIZE - 1);
+        size_t first = n < SIZE - at ? n : SIZE - at;
+        make_assignments(rng, ring + at, first);
+        make_assignments(rng, ring, n - first);
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    std::atomic<bool> wanted; // set by the consumer when it asked for a refill
+
+private:
+    AssignPool(const AssignPool&);
+    AssignPool& operator=(const AssignPool&);
+
+    Assignment ring[SIZE];
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+};
+
+// The calling thread's next assignment. The first call on a thread
+// creates its pool and, once per process, the refill thread.
+void next_assignment(Assignment &a);
+
+#endif
@@ -0,0 +1,49 @@
+// bench.h
+// Tiny helpers shared by the micro-benchmarks in bench/. With BENCH_JSON
+// set to a file name, every result is also appended to it as one JSON
+// object per line, {"bench":..,"name":..,"ops":..,"ns_per_op":..}, which
+// is what benchcmp reads.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+static inline int64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Keep the optimizer from discarding a computed value.
+template <class T> static inline void bench_keep(const T &v) {
+    asm volatile("" : : "g"(&v) : "memory");
+}
+
+static inline void bench_report(const char *name, int64_t elapsed_ns, uint64_t ops) {
+    double per_op = ops ? (double)elapsed_ns / (double)ops : 0.0;
+    printf("%-40s %12llu ops %10.2f ns/op\n", name, (unsigned long long)ops, per_op);
+
+    static FILE *json = NULL;
+    static bool opened = false;
+    if (!opened) {
+        opened = true;
+        const char *path = getenv("BENCH_JSON");
+        if (path && *path && !(json = fopen(path, "a"))) perror(path);
+    }
+    if (!json) return;
+    // Names are ours and plain; only '"' and '\\' would need escaping.
+    fprintf(json, "{\"bench\":\"%s\",\"name\":\"", program_invocation_short_name);
+    for (const char *p = name; *p; ++p) {
+        if (*p == '"' || *p == '\\') fputc('\\', json);
+        fputc(*p, json);
+    }
+    fprintf(json, "\",\"ops\":%llu,\"ns_per_op\":%.3f}\n", (unsigned long long)ops, per_op);
+    fflush(json);
+}
+
+#endif
@@ -0,0 +1,109 @@
+// benchcmp.cpp
+// Compare two BENCH_JSON result files (see bench.h). Each benchmark is
+// taken at its best ns/op over the runs in a file, which is the figure
+// least disturbed by other load. Prints base, new and the change, marks
+// changes beyond the threshold, and exits 1 if anything got slower by
+// more than that.
+// Usage: benchcmp [-t percent] base.json new.json
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+struct Results {
+    std::vector<std::string> order;      // first appearance
+    std::map<std::string, double> best;  // "bench: name" -> ns/op
+};
+
+// The string value of "key":"..." in line, unescaped.
+static bool get_string(const char *line, const char *key, std::string &out) {
+    std::string pat = std::string("\"") + key + "\":\"";
+    const char *p = strstr(line, pat.c_str());
+    if (!p) return false;
+    out.clear();
+    for (p += pat.size(); *p && *p != '"'; ++p) {
+        if (*p == '\\' && p[1]) ++p;
+        out.push_back(*p);
+    }
+    return *p == '"';
+}
+
+static bool get_number(const char *line, const char *key, double &out) {
+    std::string pat = std::string("\"") + key + "\":";
+    const char *p = strstr(line, pat.c_str());
+    if (!p) return false;
+    char *end;
+    out = strtod(p + pat.size(), &end);
+    return end != p + pat.size();
+}
+
+static bool load(const char *path, Results &r) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    char line[1024];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        std::string bench, name;
+        double ns;
+        if (!get_string(line, "bench", bench) || !get_string(line, "name", name) ||
+            !get_number(line, "ns_per_op", ns)) {
+            fprintf(stderr, "%s:%d: not a benchmark result\n", path, lineno);
+            continue;
+        }
+        std::string key = bench + ": " + name;
+        std::map<std::string, double>::iterator it = r.best.find(key);
+        if (it == r.best.end()) {
+            r.order.push_back(key);
+            r.best[key] = ns;
+        } else if (ns < it->second) {
+            it->second = ns;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    double threshold = 10.0;
+    int c;
+    while ((c = getopt(argc, argv, "t:")) != -1) {
+        if (c == 't') threshold = atof(optarg);
+        else optind = argc;
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-t percent] base.json new.json\n", argv[0]);
+        return 2;
+    }
+    Results base, cur;
+    if (!load(argv[optind], base) || !load(argv[optind + 1], cur)) return 2;
+
+    int slower = 0, faster = 0;
+    printf("%-56s %12s %12s %9s\n", "benchmark", "base ns/op", "new ns/op", "change");
+    for (const std::string &key : cur.order) {
+        double now = cur.best[key];
+        std::map<std::string, double>::iterator it = base.best.find(key);
+        if (it == base.best.end()) {
+            printf("%-56s %12s %12.2f %9s\n", key.c_str(), "-", now, "new");
+            continue;
+        }
+        double was = it->second;
+        double change = was > 0 ? (now - was) / was * 100.0 : 0.0;
+        const char *mark = "";
+        if (change > threshold) { mark = "  SLOWER"; slower++; }
+        else if (change < -threshold) { mark = "  faster"; faster++; }
+        printf("%-56s %12.2f %12.2f %+8.1f%%%s\n", key.c_str(), was, now, change, mark);
+    }
+    for (const std::string &key : base.order) {
+        if (!cur.best.count(key)) printf("%-56s %12.2f %12s %9s\n", key.c_str(), base.best[key], "-", "gone");
+    }
+    printf("%d slower, %d faster than %.0f%%\n", slower, faster, threshold);
+    return slower ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+// calceval_bench.cpp
+// Expected-result evaluation: the per-assignment ternary chain next to
+// calcEvaluateBatch/calcVerifyBatch. Also checks that the SIMD kernel
+// agrees with calcEvaluate() on random input and on the edge cases
+// (x/0, INT_MIN/-1, overflow, unknown op codes). Then the random draws
+// an assignment takes, randomInt()/randomType() as they were on rand()
+// next to the per-thread generator.
+// Usage: calceval_bench [assignments]
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "bench.h"
+#include "legacy.h"
+extern "C" {
+#include "calcLib.h"
+}
+
+static int check(int n, const uint32_t *ops, const int32_t *a, const int32_t *b) {
+    std::vector<int32_t> r(n);
+    calcEvaluateBatch(n, ops, a, b, r.data());
+    for (int i = 0; i < n; ++i) {
+        if (r[i] != calcEvaluate(ops[i], a[i], b[i])) {
+            fprintf(stderr, "calcEvaluateBatch: op %u %d %d gave %d, want %d\n",
+                    ops[i], a[i], b[i], r[i], calcEvaluate(ops[i], a[i], b[i]));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 1 << 20;
+    static const char *const kernels[] = { "scalar", "sse4.1", "avx2" };
+    printf("calcEvaluateBatch kernel: %s\n", kernels[calcSimdLevel()]);
+
+    calcRng rng;
+    calcRngSeed(&rng, 42);
+    std::vector<uint32_t> ops(n);
+    std::vector<int32_t> a(n), b(n), r(n), answers(n);
+    calcRandomBatch(&rng, n, ops.data(), a.data(), b.data(), NULL);
+
+    // Edge cases, at odd offsets so they land in vector bodies and tails.
+    const int32_t edge[] = { 0, 1, -1, 2, -2, 7, -7, 100, INT_MAX, INT_MIN, INT_MAX - 1, INT_MIN + 1 };
+    const int NE = sizeof(edge) / sizeof(edge[0]);
+    std::vector<uint32_t> eops;
+    std::vector<int32_t> ea, eb;
+    for (uint32_t op = 0; op <= 5; ++op)
+        for (int i = 0; i < NE; ++i)
+            for (int j = 0; j < NE; ++j) { eops.push_back(op); ea.push_back(edge[i]); eb.push_back(edge[j]); }
+    for (int off = 0; off < 8; ++off)
+        if (check((int)eops.size() - off, eops.data() + off, ea.data() + off, eb.data() + off)) return 1;
+    std::vector<uint32_t> rops(n);
+    std::vector<int32_t> ra(n), rb(n);
+    for (int i = 0; i < n; ++i) {
+        rops[i] = calcRngBounded(&rng, 6);
+        ra[i] = (int32_t)calcRngNext(&rng);
+        rb[i] = (int32_t)(calcRngNext(&rng) >> (calcRngBounded(&rng, 32) + 32));
+    }
+    if (check(n, rops.data(), ra.data(), rb.data())) return 1;
+
+    int64_t t0 = bench_now_ns();
+    for (int i = 0; i < n; ++i) r[i] = legacy_expected(ops[i], a[i], b[i]);
+    bench_report("ternary chain", bench_now_ns() - t0, n);
+    bench_keep(r[n / 2]);
+
+    t0 = bench_now_ns();
+    for (int i = 0; i < n; ++i) r[i] = calcEvaluate(ops[i], a[i], b[i]);
+    bench_report("calcEvaluate", bench_now_ns() - t0, n);
+    bench_keep(r[n / 2]);
+
+    t0 = bench_now_ns();
+    calcEvaluateBatch(n, ops.data(), a.data(), b.data(), r.data());
+    bench_report("calcEvaluateBatch", bench_now_ns() - t0, n);
+    bench_keep(r[n / 2]);
+
+    for (int i = 0; i < n; ++i) answers[i] = r[i] + (i % 10 == 0);
+    t0 = bench_now_ns();
+    int good = calcVerifyBatch(n, ops.data(), a.data(), b.data(), answers.data(), NULL);
+    bench_report("calcVerifyBatch", bench_now_ns() - t0, n);
+    if (good != n - (n + 9) / 10) {
+        fprintf(stderr, "calcVerifyBatch: %d correct, want %d\n", good, n - (n + 9) / 10);
+        return 1;
+    }
+
+    // One assignment's draws: an operation and two operands.
+    srand(42);
+    long sum = 0;
+    t0 = bench_now_ns();
+    for (int i = 0; i < n; ++i) sum += legacy_random_type()[0] + legacy_random_int() + legacy_random_int();
+    bench_report("draws, legacy rand()", bench_now_ns() - t0, n);
+    bench_keep(sum);
+
+    initCalcLib_seed(42);
+    t0 = bench_now_ns();
+    for (int i = 0; i < n; ++i) sum += randomType()[0] + randomInt() + randomInt();
+    bench_report("draws, randomType/randomInt", bench_now_ns() - t0, n);
+    bench_keep(sum);
+
+    t0 = bench_now_ns();
+    for (int i = 0; i < n; ++i) sum += calcRandomArith(&rng) + calcRandomInt(&rng) + calcRandomInt(&rng);
+    bench_report("draws, calcRandomArith/calcRandomInt", bench_now_ns() - t0, n);
+    bench_keep(sum);
+
+    t0 = bench_now_ns();
+    calcRandomBatch(&rng, n, ops.data(), a.data(), b.data(), NULL);
+    bench_report("draws, calcRandomBatch", bench_now_ns() - t0, n);
+    bench_keep(a[n / 2]);
+    return 0;
+}
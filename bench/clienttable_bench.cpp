@@ -0,0 +1,123 @@
+// clienttable_bench.cpp
+// Per-packet client lookups in ClientTable next to the std::map keyed on
+// sockaddr_storage it replaced: insert, hit, miss and erase, plus heap
+// bytes per client. Keys are IPv4 peers spread over addresses and ports
+// the way a NATed client population looks.
+// Usage: clienttable_bench [clients...]
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+
+#include "bench.h"
+#include "legacy.h"
+#include "clienttable.h"
+#include "udpengine.h"
+
+static std::vector<struct sockaddr_storage> make_peers(size_t n, uint32_t salt) {
+    std::vector<struct sockaddr_storage> v(n);
+    uint64_t x = 0x9e3779b97f4a7c15ULL ^ salt;
+    for (size_t i = 0; i < n; ++i) {
+        // xorshift, so neighbouring peers are not neighbouring keys
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        struct sockaddr_in *a = (struct sockaddr_in*)&v[i];
+        memset(&v[i], 0, sizeof(v[i]));
+        a->sin_family = AF_INET;
+        a->sin_addr.s_addr = htonl(0x0a000000u | (uint32_t)(x & 0xffffff));
+        a->sin_port = htons((uint16_t)(1024 + ((x >> 24) % 60000)));
+    }
+    return v;
+}
+
+static size_t heap_used() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static void run(size_t n) {
+    std::vector<struct sockaddr_storage> peers = make_peers(n, (uint32_t)n);
+    std::vector<struct sockaddr_storage> strangers = make_peers(n, (uint32_t)n + 1);
+    // Lookups in a different order than the inserts.
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) order[i] = (i * 7919) % n;
+    socklen_t len = sizeof(struct sockaddr_in);
+    char name[64];
+    size_t found;
+
+    {
+        size_t before = heap_used();
+        std::map<ClientKey, ClientState> m;
+        int64_t t0 = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) m[legacy_client_key(peers[i], len)].task_id = (uint32_t)i;
+        snprintf(name, sizeof(name), "std::map insert (%zu)", n);
+        bench_report(name, bench_now_ns() - t0, n);
+        printf("%-40s %12zu bytes/client\n", "std::map memory", (heap_used() - before) / n);
+
+        found = 0;
+        t0 = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) found += m.find(legacy_client_key(peers[order[i]], len)) != m.end();
+        snprintf(name, sizeof(name), "std::map hit (%zu)", n);
+        bench_report(name, bench_now_ns() - t0, n);
+        bench_keep(found);
+
+        t0 = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) found += m.find(legacy_client_key(strangers[i], len)) != m.end();
+        snprintf(name, sizeof(name), "std::map miss (%zu)", n);
+        bench_report(name, bench_now_ns() - t0, n);
+        bench_keep(found);
+
+        t0 = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) m.erase(legacy_client_key(peers[order[i]], len));
+        snprintf(name, sizeof(name), "std::map erase (%zu)", n);
+        bench_report(name, bench_now_ns() - t0, n);
+    }
+
+    {
+        size_t before = heap_used();
+        ClientTable<ClientState> t(n, 12345);
+        int64_t t0 = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) t.insert(client_addr(peers[i]))->task_id = (uint32_t)i;
+        snprintf(name, sizeof(name), "ClientTable insert (%zu)", n);
+        bench_report(name, bench_now_ns() - t0, n);
+        printf("%-40s %12zu bytes/client\n", "ClientTable memory", (heap_used() - before) / n);
+
+        found = 0;
+        t0 = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) found += t.find(client_addr(peers[order[i]])) != NULL;
+        snprintf(name, sizeof(name), "ClientTable hit (%zu)", n);
+        bench_report(name, bench_now_ns() - t0, n);
+        if (found != n) {
+            fprintf(stderr, "ClientTable: found %zu of %zu\n", found, n);
+            exit(1);
+        }
+
+        found = 0;
+        t0 = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) found += t.find(client_addr(strangers[i])) != NULL;
+        snprintf(name, sizeof(name), "ClientTable miss (%zu)", n);
+        bench_report(name, bench_now_ns() - t0, n);
+        bench_keep(found);
+
+        t0 = bench_now_ns();
+        for (size_t i = 0; i < n; ++i) t.erase(client_addr(peers[order[i]]));
+        snprintf(name, sizeof(name), "ClientTable erase (%zu)", n);
+        bench_report(name, bench_now_ns() - t0, n);
+        if (t.size() != 0) {
+            fprintf(stderr, "ClientTable: %zu left after erase\n", t.size());
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) run(strtoul(argv[i], NULL, 10));
+    } else {
+        run(1000);
+        run(100000);
+        run(1000000);
+    }
+    return 0;
+}
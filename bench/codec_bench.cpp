@@ -0,0 +1,122 @@
+// codec_bench.cpp
+// calcProtocol decode/encode: the per-field reads of the old UDP loop and
+// the memcpy+ntoh of the old TCP session next to wirecodec.h, one frame at
+// a time and in batches. Frames sit back to back at 26 bytes, so most of
+// them are unaligned, as in a receive buffer. Checks that all paths agree.
+// Usage: codec_bench [frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "bench.h"
+#include "legacy.h"
+#include "wirecodec.h"
+
+typedef wire::CalcProtocol CP;
+
+static bool same(const calcProtocol &a, const calcProtocol &b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 1 << 20;
+    const int ROUNDS = 8;
+
+    std::vector<calcProtocol> in(n), out(n);
+    std::vector<unsigned char> frames((size_t)n * CP::SIZE + 1), check((size_t)n * CP::SIZE);
+    // Start one byte in, so not even the first frame is aligned.
+    unsigned char *buf = frames.data() + 1;
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < n; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        calcProtocol &cp = in[i];
+        cp.type = 1 + (x & 1);
+        cp.major_version = 1;
+        cp.minor_version = 1 + (x >> 1 & 1);
+        cp.id = (uint32_t)(x >> 8);
+        cp.arith = 1 + (x >> 40) % 4;
+        cp.inValue1 = (uint32_t)(x >> 16);
+        cp.inValue2 = (uint32_t)(x >> 24);
+        cp.inResult = (uint32_t)(x >> 32);
+    }
+
+    // All encoders must produce the same bytes and all decoders the same fields.
+    CP::encode_batch(buf, n, in.data());
+    for (int i = 0; i < n; ++i) legacy_udp_encode(check.data() + (size_t)i * CP::SIZE, in[i]);
+    if (memcmp(buf, check.data(), check.size()) != 0) {
+        fprintf(stderr, "wire encode differs from the legacy UDP encoder\n");
+        return 1;
+    }
+    for (int i = 0; i < n; ++i) {
+        calcProtocol u, t, w;
+        const unsigned char *f = buf + (size_t)i * CP::SIZE;
+        legacy_udp_decode(f, u);
+        legacy_tcp_decode(f, t);
+        CP::decode(f, w);
+        if (!same(u, in[i]) || !same(t, in[i]) || !same(w, in[i]) ||
+            CP::get<&calcProtocol::inResult>(f) != in[i].inResult) {
+            fprintf(stderr, "decoders disagree on frame %d\n", i);
+            return 1;
+        }
+    }
+
+    uint64_t ops = (uint64_t)n * ROUNDS;
+    int64_t t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < n; ++i) legacy_udp_decode(buf + (size_t)i * CP::SIZE, out[i]);
+    bench_report("decode, legacy udp read_u*_be", bench_now_ns() - t0, ops);
+    bench_keep(out[n / 2]);
+
+    t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < n; ++i) legacy_tcp_decode(buf + (size_t)i * CP::SIZE, out[i]);
+    bench_report("decode, legacy tcp memcpy+ntoh", bench_now_ns() - t0, ops);
+    bench_keep(out[n / 2]);
+
+    t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < n; ++i) CP::decode(buf + (size_t)i * CP::SIZE, out[i]);
+    bench_report("decode, wire", bench_now_ns() - t0, ops);
+    bench_keep(out[n / 2]);
+
+    t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r) CP::decode_batch(buf, n, out.data());
+    bench_report("decode, wire batch", bench_now_ns() - t0, ops);
+    bench_keep(out[n / 2]);
+
+    uint64_t sum = 0;
+    t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r) {
+        for (int i = 0; i < n; ++i) {
+            const unsigned char *f = buf + (size_t)i * CP::SIZE;
+            sum += CP::get<&calcProtocol::id>(f) ^ CP::get<&calcProtocol::inResult>(f);
+        }
+    }
+    bench_report("id+inResult, wire get", bench_now_ns() - t0, ops);
+    bench_keep(sum);
+
+    t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < n; ++i) legacy_udp_encode(buf + (size_t)i * CP::SIZE, in[i]);
+    bench_report("encode, legacy udp write_u*_be", bench_now_ns() - t0, ops);
+    bench_keep(buf[n / 2]);
+
+    t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < n; ++i) legacy_tcp_encode(buf + (size_t)i * CP::SIZE, in[i]);
+    bench_report("encode, legacy tcp hton+memcpy", bench_now_ns() - t0, ops);
+    bench_keep(buf[n / 2]);
+
+    t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r)
+        for (int i = 0; i < n; ++i) CP::encode(buf + (size_t)i * CP::SIZE, in[i]);
+    bench_report("encode, wire", bench_now_ns() - t0, ops);
+    bench_keep(buf[n / 2]);
+
+    t0 = bench_now_ns();
+    for (int r = 0; r < ROUNDS; ++r) CP::encode_batch(buf, n, in.data());
+    bench_report("encode, wire batch", bench_now_ns() - t0, ops);
+    bench_keep(buf[n / 2]);
+    return 0;
+}
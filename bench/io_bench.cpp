@@ -0,0 +1,121 @@
+// io_bench.cpp
+// Reading client messages off a socket: recv_line()/full_read() as the
+// blocking server had them (one read() per byte for a line) next to
+// InputBuffer, which reads in chunks and splits lines with memchr. Each
+// round writes a block of messages into a socketpair and times reading
+// them back; both readers must see the same messages.
+// Usage: io_bench [rounds]
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "legacy.h"
+#include "inbuf.h"
+
+static const int LINES = 2000;
+static const size_t FRAME = 26;  // sizeof(calcProtocol)
+static const int FRAMES = 2000;
+
+static void write_all(int fd, const std::string &s) {
+    size_t off = 0;
+    while (off < s.size()) {
+        ssize_t w = write(fd, s.data() + off, s.size() - off);
+        if (w <= 0) {
+            perror("write");
+            exit(1);
+        }
+        off += w;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 50;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    int big = 1 << 20;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &big, sizeof(big));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &big, sizeof(big));
+
+    // What a 1.1 text client sends: a selection, then an answer.
+    std::string lines;
+    size_t line_bytes = 0;
+    for (int i = 0; i < LINES; ++i) {
+        char l[32];
+        int n = i % 2 ? snprintf(l, sizeof(l), "%d\n", i * 7919 - 500000) : snprintf(l, sizeof(l), "TEXT TCP 1.1 OK\n");
+        lines.append(l, n);
+        line_bytes += n - 1;
+    }
+    std::string frames(FRAME * FRAMES, '\0');
+    for (size_t i = 0; i < frames.size(); ++i) frames[i] = (char)(i * 31);
+
+    int64_t legacy_ns = 0, inbuf_ns = 0;
+    size_t legacy_bytes = 0, inbuf_bytes = 0;
+    for (int r = 0; r < rounds; ++r) {
+        write_all(sv[0], lines);
+        int64_t t0 = bench_now_ns();
+        std::string line;
+        for (int i = 0; i < LINES; ++i) {
+            if (legacy_recv_line(sv[1], line) <= 0) return 1;
+            legacy_bytes += line.size() - 1;
+        }
+        legacy_ns += bench_now_ns() - t0;
+
+        write_all(sv[0], lines);
+        InputBuffer in;
+        t0 = bench_now_ns();
+        for (int i = 0; i < LINES; ++i) {
+            std::string_view v;
+            while (!in.read_line(v)) {
+                if (in.fill(sv[1]) <= 0) return 1;
+            }
+            inbuf_bytes += v.size();
+        }
+        inbuf_ns += bench_now_ns() - t0;
+    }
+    if (legacy_bytes != inbuf_bytes || inbuf_bytes != line_bytes * rounds) {
+        fprintf(stderr, "line readers disagree: %zu vs %zu bytes\n", legacy_bytes, inbuf_bytes);
+        return 1;
+    }
+    bench_report("line, legacy recv_line", legacy_ns, (uint64_t)LINES * rounds);
+    bench_report("line, InputBuffer", inbuf_ns, (uint64_t)LINES * rounds);
+
+    legacy_ns = inbuf_ns = 0;
+    uint64_t legacy_sum = 0, inbuf_sum = 0;
+    for (int r = 0; r < rounds; ++r) {
+        write_all(sv[0], frames);
+        int64_t t0 = bench_now_ns();
+        char f[FRAME];
+        for (int i = 0; i < FRAMES; ++i) {
+            if (legacy_full_read(sv[1], f, FRAME) != (ssize_t)FRAME) return 1;
+            legacy_sum += (unsigned char)f[i % FRAME];
+        }
+        legacy_ns += bench_now_ns() - t0;
+
+        write_all(sv[0], frames);
+        InputBuffer in;
+        t0 = bench_now_ns();
+        for (int i = 0; i < FRAMES; ++i) {
+            const char *p;
+            while (!in.take(FRAME, p)) {
+                if (in.fill(sv[1]) <= 0) return 1;
+            }
+            inbuf_sum += (unsigned char)p[i % FRAME];
+        }
+        inbuf_ns += bench_now_ns() - t0;
+    }
+    if (legacy_sum != inbuf_sum) {
+        fprintf(stderr, "frame readers disagree\n");
+        return 1;
+    }
+    bench_report("frame, legacy full_read", legacy_ns, (uint64_t)FRAMES * rounds);
+    bench_report("frame, InputBuffer", inbuf_ns, (uint64_t)FRAMES * rounds);
+    return 0;
+}
@@ -0,0 +1,209 @@
+// legacy.h
+// Pieces of the servers as they were before being replaced, kept so the
+// benchmarks can measure the old path next to the new one.
+
+#ifndef LEGACY_H
+#define LEGACY_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <ctype.h>
+#include <string>
+#include <algorithm>
+
+// udpservermain.cpp std::map key.
+struct ClientKey {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    bool operator<(const ClientKey& o) const {
+        if (ss.ss_family != o.ss.ss_family) return ss.ss_family < o.ss.ss_family;
+        if (ss.ss_family == AF_INET) {
+            const auto a = (const struct sockaddr_in*)&ss;
+            const auto b = (const struct sockaddr_in*)&o.ss;
+            uint16_t pa = ntohs(a->sin_port);
+            uint16_t pb = ntohs(b->sin_port);
+            if (pa != pb) return pa < pb;
+            uint32_t ia = ntohl(a->sin_addr.s_addr);
+            uint32_t ib = ntohl(b->sin_addr.s_addr);
+            return ia < ib;
+        } else if (ss.ss_family == AF_INET6) {
+            const auto a = (const struct sockaddr_in6*)&ss;
+            const auto b = (const struct sockaddr_in6*)&o.ss;
+            int cmp = memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+            if (cmp != 0) return cmp < 0;
+            uint16_t pa = ntohs(a->sin6_port);
+            uint16_t pb = ntohs(b->sin6_port);
+            return pa < pb;
+        }
+        return false;
+    }
+};
+
+// How the old loop built a key from recvfrom()'s address.
+static inline ClientKey legacy_client_key(const struct sockaddr_storage &cliaddr, socklen_t clilen) {
+    ClientKey key; memset(&key, 0, sizeof(key));
+    if (clilen <= (socklen_t)sizeof(key.ss)) {
+        memcpy(&key.ss, &cliaddr, clilen);
+        if (clilen < (socklen_t)sizeof(key.ss)) memset(((char*)&key.ss) + clilen, 0, sizeof(key.ss) - clilen);
+    } else {
+        memcpy(&key.ss, &cliaddr, sizeof(key.ss));
+    }
+    key.len = clilen;
+    return key;
+}
+
+// The ternary chain the servers used for expected results.
+static inline int32_t legacy_expected(uint32_t code, int32_t a, int32_t b) {
+    return (code==1? a+b : code==2? a-b : code==3? a*b : a/b);
+}
+
+// udpservermain.cpp frame decoding: one read per field at fixed offsets.
+static inline uint16_t legacy_read_u16_be(const unsigned char *buf) { uint16_t v; memcpy(&v, buf, sizeof(v)); return ntohs(v); }
+static inline uint32_t legacy_read_u32_be(const unsigned char *buf) { uint32_t v; memcpy(&v, buf, sizeof(v)); return ntohl(v); }
+static inline void legacy_write_u16_be(unsigned char *buf, uint16_t v) { uint16_t t = htons(v); memcpy(buf, &t, sizeof(t)); }
+static inline void legacy_write_u32_be(unsigned char *buf, uint32_t v) { uint32_t t = htonl(v); memcpy(buf, &t, sizeof(t)); }
+
+template <class CP> static inline void legacy_udp_decode(const unsigned char *b, CP &cp) {
+    cp.type = legacy_read_u16_be(b + 0);
+    cp.major_version = legacy_read_u16_be(b + 2);
+    cp.minor_version = legacy_read_u16_be(b + 4);
+    cp.id = legacy_read_u32_be(b + 6);
+    cp.arith = legacy_read_u32_be(b +10);
+    cp.inValue1 = legacy_read_u32_be(b +14);
+    cp.inValue2 = legacy_read_u32_be(b +18);
+    cp.inResult = legacy_read_u32_be(b +22);
+}
+
+template <class CP> static inline void legacy_udp_encode(unsigned char *b, const CP &cp) {
+    legacy_write_u16_be(b + 0, cp.type);
+    legacy_write_u16_be(b + 2, cp.major_version);
+    legacy_write_u16_be(b + 4, cp.minor_version);
+    legacy_write_u32_be(b + 6, cp.id);
+    legacy_write_u32_be(b +10, cp.arith);
+    legacy_write_u32_be(b +14, cp.inValue1);
+    legacy_write_u32_be(b +18, cp.inValue2);
+    legacy_write_u32_be(b +22, cp.inResult);
+}
+
+// tcpsession.cpp frame decoding: copy the packed struct, then ntoh the fields.
+template <class CP> static inline void legacy_tcp_decode(const unsigned char *frame, CP &cp) {
+    memcpy(&cp, frame, sizeof(cp));
+    cp.type = ntohs(cp.type);
+    cp.major_version = ntohs(cp.major_version);
+    cp.minor_version = ntohs(cp.minor_version);
+    cp.id = ntohl(cp.id);
+    cp.arith = ntohl(cp.arith);
+    cp.inValue1 = ntohl(cp.inValue1);
+    cp.inValue2 = ntohl(cp.inValue2);
+    cp.inResult = ntohl(cp.inResult);
+}
+
+template <class CP> static inline void legacy_tcp_encode(unsigned char *frame, const CP &in) {
+    CP cp = in;
+    cp.type = htons(cp.type);
+    cp.major_version = htons(cp.major_version);
+    cp.minor_version = htons(cp.minor_version);
+    cp.id = htonl(cp.id);
+    cp.arith = htonl(cp.arith);
+    cp.inValue1 = htonl(cp.inValue1);
+    cp.inValue2 = htonl(cp.inValue2);
+    cp.inResult = htonl(cp.inResult);
+    memcpy(frame, &cp, sizeof(cp));
+}
+
+// tcpsession.cpp 1.1 text answer check before textproto.h.
+static inline bool legacy_check_text_answer(const std::string &in, int32_t expected, int &answer_int) {
+    std::string line(in);
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+        line.pop_back();
+    line.erase(std::remove_if(line.begin(), line.end(), ::isspace), line.end());
+
+    bool ok = false;
+    double answer_double = 0.0;
+    answer_int = 0;
+    if (sscanf(line.c_str(), "%d", &answer_int) == 1) {
+        if (answer_int == expected) ok = true;
+    } else if (sscanf(line.c_str(), "%lf", &answer_double) == 1) {
+        if (fabs(answer_double - expected) < 0.0001) ok = true;
+    }
+    return ok;
+}
+
+// tcpsession.cpp protocol selection: 0 none, 1..4 = binary 1.1, text 1.1,
+// binary 1.2, text 1.2. window is the "%d" after a 1.2 selection.
+static inline int legacy_select(const std::string &line, int &window) {
+    std::string client_response(line);
+    while (!client_response.empty() && (client_response.back() == '\n' || client_response.back() == '\r'))
+        client_response.pop_back();
+    std::string lower = client_response;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    size_t at;
+    window = 1;
+    if (lower.find("binary tcp 1.1 ok") != std::string::npos) return 1;
+    if (lower.find("text tcp 1.1 ok") != std::string::npos) return 2;
+    int kind = 0;
+    if ((at = lower.find("binary tcp 1.2 ok")) != std::string::npos) { kind = 3; at += 17; }
+    else if ((at = lower.find("text tcp 1.2 ok")) != std::string::npos) { kind = 4; at += 15; }
+    else return 0;
+    std::string a(lower.substr(at));
+    if (sscanf(a.c_str(), "%d", &window) != 1) window = 1;
+    return kind;
+}
+
+// udpengine.cpp stateless text answer, "<result> <token>".
+static inline bool legacy_udp_answer(const char *buf, size_t n, int32_t &res, std::string &token) {
+    std::string s(buf, n);
+    while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) s.pop_back();
+    char hex[42];
+    if (sscanf(s.c_str(), "%d %41s", &res, hex) != 2 || strlen(hex) != 40) return false;
+    token = hex;
+    return true;
+}
+
+// tcpservermain.cpp socket reads, one read() per byte for lines.
+static inline ssize_t legacy_full_read(int fd, void *buf, size_t count) {
+    size_t done = 0;
+    char *p = (char*)buf;
+    while (done < count) {
+        ssize_t r = read(fd, p + done, count - done);
+        if (r == 0) return done;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += r;
+    }
+    return (ssize_t)done;
+}
+
+static inline ssize_t legacy_recv_line(int fd, std::string &out) {
+    out.clear();
+    char c;
+    while (1) {
+        ssize_t r = read(fd, &c, 1);
+        if (r == 0) return 0;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        out.push_back(c);
+        if (c == '\n') break;
+    }
+    return out.size();
+}
+
+// calcLib.c generator before xoshiro256**: the process wide rand().
+static const char *const legacy_arith[] = { "add", "div", "mul" };
+static inline const char *legacy_random_type() { return legacy_arith[rand() % 3]; }
+static inline int legacy_random_int() { return rand() % 100; }
+
+#endif
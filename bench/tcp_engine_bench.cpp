@@ -0,0 +1,168 @@
+// tcp_engine_bench.cpp
+// Runs ./tcpserver once per engine (-e epoll, -e uring) and drives it with
+// a closed loop of TEXT TCP 1.1 sessions over loopback, reporting completed
+// sessions per second and mean session latency for each.
+// Usage: tcp_engine_bench [concurrency] [seconds] [server binary]
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+
+struct Client {
+    int fd;
+    int phase; // 0 greeting, 1 assignment, 2 verdict
+    std::string in;
+    int64_t started;
+};
+
+static int answer(const char *line) {
+    char op[8];
+    int a, b;
+    if (sscanf(line, "ASSIGNMENT: %7s %d %d", op, &a, &b) != 3) return 0;
+    if (strcmp(op, "add") == 0) return a + b;
+    if (strcmp(op, "sub") == 0) return a - b;
+    if (strcmp(op, "mul") == 0) return a * b;
+    return b ? a / b : 0;
+}
+
+static int open_conn(int ep, struct sockaddr_in *addr, Client *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    if (connect(c->fd, (struct sockaddr*)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        return -1;
+    }
+    c->phase = 0;
+    c->in.clear();
+    c->started = bench_now_ns();
+    struct epoll_event e{};
+    e.events = EPOLLIN;
+    e.data.ptr = c;
+    return epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &e);
+}
+
+// Poll the port with blocking connects until the server listens. False if
+// the server exited or took longer than five seconds.
+static bool wait_listening(int port, pid_t server) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int tries = 0; tries < 500; ++tries) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return false;
+        int rv = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+        close(fd);
+        if (rv == 0) return true;
+        if (waitpid(server, NULL, WNOHANG) != 0) return false;
+        usleep(10000);
+    }
+    return false;
+}
+
+static void run_load(int port, int conc, int seconds, const char *engine) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int ep = epoll_create1(0);
+    std::vector<Client> clients(conc);
+    for (int i = 0; i < conc; ++i) open_conn(ep, &addr, &clients[i]);
+
+    uint64_t done = 0, failed = 0;
+    int64_t lat_sum = 0;
+    int64_t start = bench_now_ns();
+    int64_t end = start + (int64_t)seconds * 1000000000;
+    struct epoll_event evs[256];
+    while (bench_now_ns() < end) {
+        int n = epoll_wait(ep, evs, 256, 100);
+        for (int i = 0; i < n; ++i) {
+            Client *c = (Client*)evs[i].data.ptr;
+            char buf[256];
+            ssize_t r = read(c->fd, buf, sizeof(buf));
+            if (r <= 0) {
+                if (r < 0 && errno == EAGAIN) continue;
+                failed++;
+                close(c->fd);
+                open_conn(ep, &addr, c);
+                continue;
+            }
+            c->in.append(buf, r);
+            if (c->phase == 0 && c->in.find("\n\n") != std::string::npos) {
+                c->in.clear();
+                c->phase = 1;
+                ssize_t w = write(c->fd, "TEXT TCP 1.1 OK\n", 16);
+                (void)w;
+            } else if (c->phase == 1 && c->in.find('\n') != std::string::npos) {
+                char reply[32];
+                int len = snprintf(reply, sizeof(reply), "%d\n", answer(c->in.c_str()));
+                c->in.clear();
+                c->phase = 2;
+                ssize_t w = write(c->fd, reply, len);
+                (void)w;
+            } else if (c->phase == 2 && c->in.find('\n') != std::string::npos) {
+                if (c->in.compare(0, 2, "OK") == 0) done++;
+                else failed++;
+                lat_sum += bench_now_ns() - c->started;
+                close(c->fd);
+                open_conn(ep, &addr, c);
+            }
+        }
+    }
+    int64_t elapsed = bench_now_ns() - start;
+    for (int i = 0; i < conc; ++i) close(clients[i].fd);
+    close(ep);
+
+    printf("%-8s %10.0f sessions/s %10.1f us/session %8llu failed\n", engine,
+           done * 1e9 / elapsed, done ? lat_sum / 1000.0 / done : 0.0, (unsigned long long)failed);
+    char name[64];
+    snprintf(name, sizeof(name), "%s, wall time per session", engine);
+    bench_report(name, elapsed, done);
+}
+
+int main(int argc, char *argv[]) {
+    int conc = argc > 1 ? atoi(argv[1]) : 64;
+    int seconds = argc > 2 ? atoi(argv[2]) : 3;
+    const char *server = argc > 3 ? argv[3] : "./tcpserver";
+    const char *engines[] = { "epoll", "uring" };
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int e = 0; e < 2; ++e) {
+        int port = 20000 + (getpid() % 20000) + e;
+        char hostport[64];
+        snprintf(hostport, sizeof(hostport), "127.0.0.1:%d", port);
+        pid_t pid = fork();
+        if (pid == 0) {
+            int devnull = open("/dev/null", O_WRONLY);
+            dup2(devnull, 2);
+            execl(server, server, "-e", engines[e], hostport, (char*)NULL);
+            _exit(127);
+        }
+        if (!wait_listening(port, pid)) {
+            fprintf(stderr, "%s: server on port %d did not come up\n", engines[e], port);
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+            return 1;
+        }
+        run_load(port, conc, seconds, engines[e]);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
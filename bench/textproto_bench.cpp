@@ -0,0 +1,203 @@
+// textproto_bench.cpp
+// Text protocol parsing and formatting: the sscanf/std::string code the
+// servers used next to textproto.h. Before timing, random lines (signs,
+// digits, points, exponents, inf/nan, white space, NULs, long digit runs,
+// mixed case protocol names) are fed to both and every answer verdict,
+// integer, protocol selection, window and UDP token must come out the
+// same. The textproto side is the functions the servers call; answers
+// longer than textproto::ANSWER_MAX must be rejected instead.
+// Usage: textproto_bench [fuzz cases]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "legacy.h"
+#include "textproto.h"
+
+static uint64_t rng_state = 0x243f6a8885a308d3ULL;
+
+static uint64_t next() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static std::string random_answer() {
+    static const char alphabet[] = "0123456789+-.eEinfatyINFNAxX \t\r\n\v\f()_";
+    static const char *const pieces[] = {
+        "2147483647", "2147483648", "-2147483649", "99999999999999999999", "4294967296",
+        "1e400", "1e-400", ".1e-400", "0.00001", ".00001e", "1e", "1e+", "inf", "-nan",
+        "infinity", "nan(12)", "00000000000000000000000000000000000000000000000000001",
+        "0.000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "000000000000000000000000000001",
+    };
+    std::string s;
+    int len = (int)(next() % 12);
+    for (int i = 0; i < len; ++i) {
+        uint64_t r = next();
+        if (r % 16 == 0) s += pieces[(r >> 8) % (sizeof(pieces) / sizeof(pieces[0]))];
+        else if (r % 61 == 1) s += '\0';
+        else s += alphabet[(r >> 8) % (sizeof(alphabet) - 1)];
+    }
+    if (next() % 2) s += '\n';
+    return s;
+}
+
+static std::string random_selection() {
+    static const char *const names[] = { "binary tcp 1.1 ok", "text tcp 1.1 ok",
+                                         "binary tcp 1.2 ok", "text tcp 1.2 ok", "text tcp 1.3 ok" };
+    std::string s;
+    if (next() % 4 == 0) s += "xX ";
+    std::string n = names[next() % 5];
+    for (char &c : n) if (next() % 3 == 0) c = (char)toupper(c);
+    if (next() % 8 == 0) n.erase(next() % n.size(), 1);
+    s += n;
+    s += random_answer();
+    return s;
+}
+
+static std::string random_udp_answer() {
+    std::string s = random_answer();
+    if (next() % 2) s += ' ';
+    static const char hex[] = "0123456789abcdef";
+    int len = next() % 4 ? 40 : (int)(next() % 44);
+    for (int i = 0; i < len; ++i) s += hex[next() % 16];
+    if (next() % 4 == 0) s += " trailing";
+    if (next() % 2) s += "\r\n";
+    return s;
+}
+
+static int fuzz(int cases) {
+    for (int i = 0; i < cases; ++i) {
+        std::string a = random_answer();
+        int32_t expected = next() % 4 ? 0 : (int32_t)(next() % 7) - 3;
+        int li, ni;
+        bool nok = textproto::check_answer(a, expected, ni);
+        static char stripped[1 << 16];
+        if (textproto::strip_space(a, stripped, sizeof(stripped)) > textproto::ANSWER_MAX) {
+            // Rejected by design where sscanf read on.
+            if (nok || ni != 0) {
+                fprintf(stderr, "answer \"%s\": over ANSWER_MAX but not rejected\n", a.c_str());
+                return 1;
+            }
+            continue;
+        }
+        bool lok = legacy_check_text_answer(a, expected, li);
+        if (lok != nok || li != ni) {
+            fprintf(stderr, "answer \"%s\" (expected %d): legacy %d/%d, textproto %d/%d\n",
+                    a.c_str(), expected, lok, li, nok, ni);
+            return 1;
+        }
+
+        std::string sel = random_selection();
+        int lw, nw;
+        int lk = legacy_select(sel, lw), nk = textproto::parse_selection(sel, nw);
+        if (lk != nk || lw != nw) {
+            fprintf(stderr, "selection \"%s\": legacy %d/%d, textproto %d/%d\n", sel.c_str(), lk, lw, nk, nw);
+            return 1;
+        }
+
+        std::string u = random_udp_answer();
+        if (u.find('\0') != std::string::npos) continue;  // the UDP path drops those first
+        int32_t lr = 0, nr = 0;
+        std::string lt;
+        std::string_view nt;
+        bool lu = legacy_udp_answer(u.data(), u.size(), lr, lt);
+        bool nu = textproto::parse_token_answer(u, 40, nr, nt);
+        if (lu != nu || (lu && (lr != nr || lt != nt))) {
+            fprintf(stderr, "udp answer \"%s\": legacy %d/%d, textproto %d/%d\n", u.c_str(), lu, lr, nu, nr);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int cases = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (fuzz(cases)) return 1;
+    printf("textproto agrees with the legacy parsers on %d random inputs\n", cases);
+
+    const int N = 1 << 20;
+    static const char *const answers[] = { "1234\n", " -56 \r\n", "7 8\n", "3.0\n", "-2147483648\n", "abc\n" };
+    std::vector<std::string> lines(N);
+    for (int i = 0; i < N; ++i) lines[i] = answers[i % 6];
+
+    int sum = 0, v;
+    int64_t t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) sum += legacy_check_text_answer(lines[i], 1234, v) + v;
+    bench_report("answer check, legacy sscanf", bench_now_ns() - t0, N);
+    bench_keep(sum);
+
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) sum += textproto::check_answer(lines[i], 1234, v) + v;
+    bench_report("answer check, textproto", bench_now_ns() - t0, N);
+    bench_keep(sum);
+
+    std::string sel = "BINARY TCP 1.2 OK 16\r\n";
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) sum += legacy_select(sel, v) + v;
+    bench_report("selection, legacy tolower+find", bench_now_ns() - t0, N);
+    bench_keep(sum);
+
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) sum += textproto::parse_selection(sel, v) + v;
+    bench_report("selection, textproto ifind", bench_now_ns() - t0, N);
+    bench_keep(sum);
+
+    std::string u = "-12345 0123456789abcdef0123456789abcdef01234567\n";
+    std::string lt;
+    std::string_view nt;
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) sum += legacy_udp_answer(u.data(), u.size(), v, lt) + v;
+    bench_report("udp token answer, legacy sscanf", bench_now_ns() - t0, N);
+    bench_keep(sum);
+
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) sum += textproto::parse_token_answer(u, 40, v, nt) + v;
+    bench_report("udp token answer, textproto", bench_now_ns() - t0, N);
+    bench_keep(sum);
+
+    char buf[64];
+    size_t len = 0;
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) len += snprintf(buf, sizeof(buf), "ASSIGNMENT: %s %d %d\n", "mul", i, -i);
+    bench_report("assignment line, snprintf", bench_now_ns() - t0, N);
+    bench_keep(len);
+
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) len += textproto::format_assignment(buf, "mul", i, -i);
+    bench_report("assignment line, to_chars", bench_now_ns() - t0, N);
+    bench_keep(len);
+
+    for (int i = -3; i < 3; ++i) {
+        char want[64];
+        int wl = snprintf(want, sizeof(want), "OK (myresult=%d)\n", i * 715827882);
+        size_t gl = textproto::format_ok_line(buf, i * 715827882);
+        if ((size_t)wl != gl || memcmp(want, buf, gl) != 0) {
+            fprintf(stderr, "format_ok_line differs from snprintf for %d\n", i * 715827882);
+            return 1;
+        }
+        wl = snprintf(want, sizeof(want), "ASSIGNMENT: div %d %d\n", i * 715827882, i < 0 ? INT32_MIN : INT32_MAX - i);
+        gl = textproto::format_assignment(buf, "div", i * 715827882, i < 0 ? INT32_MIN : INT32_MAX - i);
+        if ((size_t)wl != gl || memcmp(want, buf, gl) != 0) {
+            fprintf(stderr, "format_assignment differs from snprintf for %d\n", i * 715827882);
+            return 1;
+        }
+    }
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) len += snprintf(buf, sizeof(buf), "OK (myresult=%d)\n", i);
+    bench_report("ok line, snprintf", bench_now_ns() - t0, N);
+    bench_keep(len);
+
+    t0 = bench_now_ns();
+    for (int i = 0; i < N; ++i) len += textproto::format_ok_line(buf, i);
+    bench_report("ok line, to_chars", bench_now_ns() - t0, N);
+    bench_keep(len);
+    return 0;
+}
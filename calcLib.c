@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
 
 /* Here we use " as the calcLib.c and calcLib.h files are in the same folder, and are to be BUILT
    to into a library, that will be included in other files. 
@@ -17,9 +19,32 @@ char *arith[]={"add","div","mul"};
 /* Used for random number */
 time_t myData_seedValue;
 
+/* Seed the per-thread generators derive from, and a counter that is bumped on
+   every init so threads notice they must reseed. Threads number themselves from
+   calcThreadCount. */
+static uint64_t calcBaseSeed;
+static unsigned calcSeedEpoch;
+static unsigned calcThreadCount;
+
+static __thread calcRng calcTlsRng;
+static __thread unsigned calcTlsEpoch;  /* 0 = never seeded */
+static __thread unsigned calcTlsIndex;
+
+static void calcSetBaseSeed(uint64_t seed){
+  __atomic_store_n(&calcBaseSeed, seed, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&calcSeedEpoch, 1, __ATOMIC_RELEASE);
+}
+
 int initCalcLib(void){
   /* Init the random number generator with a seed, based on the current time--> should be randomish each time called */
   srand((unsigned) time(&myData_seedValue));
+
+  /* The per-thread generators get a proper random seed when the kernel has one for us. */
+  uint64_t seed;
+  if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != (ssize_t)sizeof(seed)) {
+    seed = (uint64_t)myData_seedValue ^ ((uint64_t)getpid() << 32);
+  }
+  calcSetBaseSeed(seed);
   return(0);
 }
 
@@ -35,8 +60,92 @@ int initCalcLib_seed(unsigned int seed){
   
   myData_seedValue=seed;
   srand(seed);
+  calcSetBaseSeed(seed);
   return(0);
 }
+
+/* splitmix64, used to turn one 64 bit seed into a xoshiro state. */
+static uint64_t calcSplitMix(uint64_t *x){
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void calcRngSeed(calcRng *rng, uint64_t seed){
+  int i;
+  for (i = 0; i < 4; i++) rng->s[i] = calcSplitMix(&seed);
+}
+
+static inline uint64_t calcRotl(uint64_t x, int k){
+  return (x << k) | (x >> (64 - k));
+}
+
+/* xoshiro256** (Blackman & Vigna). */
+uint64_t calcRngNext(calcRng *rng){
+  uint64_t *s = rng->s;
+  uint64_t result = calcRotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = calcRotl(s[3], 45);
+  return result;
+}
+
+/* Lemire's multiply-shift: take the high half of a 32x32 product, and redraw
+   the rare low halves that would make some results more likely than others. */
+uint32_t calcRngBounded(calcRng *rng, uint32_t bound){
+  uint64_t m = (uint64_t)(uint32_t)calcRngNext(rng) * bound;
+  uint32_t low = (uint32_t)m;
+  if (low < bound) {
+    uint32_t threshold = (0u - bound) % bound;
+    while (low < threshold) {
+      m = (uint64_t)(uint32_t)calcRngNext(rng) * bound;
+      low = (uint32_t)m;
+    }
+  }
+  return (uint32_t)(m >> 32);
+}
+
+calcRng *calcRngThread(void){
+  unsigned epoch = __atomic_load_n(&calcSeedEpoch, __ATOMIC_ACQUIRE);
+  if (calcTlsEpoch != epoch || epoch == 0) {
+    if (epoch == 0) {
+      /* Library used without init: behave as if initCalcLib() had been called. */
+      initCalcLib();
+      epoch = __atomic_load_n(&calcSeedEpoch, __ATOMIC_ACQUIRE);
+    }
+    if (calcTlsEpoch == 0) calcTlsIndex = __atomic_fetch_add(&calcThreadCount, 1, __ATOMIC_RELAXED);
+    calcRngSeed(&calcTlsRng, __atomic_load_n(&calcBaseSeed, __ATOMIC_RELAXED) ^ ((uint64_t)calcTlsIndex * 0xd1b54a32d192ed03ULL));
+    calcTlsEpoch = epoch;
+  }
+  return &calcTlsRng;
+}
+
+int calcRandomInt(calcRng *rng){
+  return (int)calcRngBounded(rng, 100);
+}
+
+uint32_t calcRandomArith(calcRng *rng){
+  return calcRngBounded(rng, 4) + 1;
+}
+
+void calcRandomBatch(calcRng *rng, int n, uint32_t *ops, int32_t *v1, int32_t *v2, uint32_t *ids){
+  int i;
+  for (i = 0; i < n; i++) {
+    uint32_t op = calcRandomArith(rng);
+    if (ops) ops[i] = op;
+    if (v1) v1[i] = calcRandomInt(rng);
+    if (v2) {
+      /* 1..99 for a division, the same distribution the servers used to get by redrawing zeros. */
+      v2[i] = (op == 4) ? (int32_t)calcRngBounded(rng, 99) + 1 : calcRandomInt(rng);
+    }
+    if (ids) ids[i] = (uint32_t)(calcRngNext(rng) >> 32);
+  }
+}
   
 char *randomType(void){
   int Listitems=sizeof(arith)/(sizeof(char*)); 
@@ -44,9 +153,9 @@ char *randomType(void){
      First we get the total size that the array of pointers use, sizeof(arith). Then we divide with 
      the size of a pointer (sizeof(char*)), this gives us the number of pointers in the list. 
   */
-  int itemPos=rand() % Listitems;
-  /* As we know the number of items, we can just draw a random number and modulo it with the number 
-     of items in the list, then we will get a random number between 0 and the number of items in the list 
+  int itemPos=(int)calcRngBounded(calcRngThread(), Listitems);
+  /* As we know the number of items, we can just draw a random number between 0 and the number of items
+     in the list (without the bias a plain rand() % Listitems would have).
      
      Using that information, we just return the string found at that position arith[itemPos];
   */
@@ -56,10 +165,148 @@ char *randomType(void){
 
 
 int randomInt(void){
-  /* Draw a random interger between o and RAND_MAX, then modulo this with 100 to get a random 
-     number between 0 and 100. */
+  /* Draw a random interger between 0 and 99, from the calling thread's generator. */
   
-  return( rand()%100 );
+  return( calcRandomInt(calcRngThread()) );
 };
 
 
+
+
+/* Reference semantics for the evaluators below: C int arithmetic, wrapping on
+   overflow, division truncating toward zero. x/0 gives 0 and INT_MIN/-1 wraps
+   to INT_MIN instead of trapping; unknown op codes give 0. */
+int32_t calcEvaluate(uint32_t op, int32_t a, int32_t b){
+  switch (op) {
+  case 1: return (int32_t)((uint32_t)a + (uint32_t)b);
+  case 2: return (int32_t)((uint32_t)a - (uint32_t)b);
+  case 3: return (int32_t)((uint32_t)a * (uint32_t)b);
+  case 4:
+    if (b == 0) return 0;
+    if (b == -1) return (int32_t)(0u - (uint32_t)a);
+    return a / b;
+  default: return 0;
+  }
+}
+
+static void calcEvaluateScalar(int n, const uint32_t *ops, const int32_t *v1, const int32_t *v2, int32_t *results){
+  int i;
+  for (i = 0; i < n; i++) results[i] = calcEvaluate(ops[i], v1[i], v2[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* There is no SIMD integer division, so quotients go through double: every
+   int32 is exact in a double and the rounded quotient never crosses an integer
+   boundary, so truncating it gives the C result. INT_MIN/-1 = 2^31 is out of
+   range and the conversion yields 0x80000000, which is the wrapped result;
+   x/0 is masked to 0 afterwards. */
+
+__attribute__((target("avx2")))
+static void calcEvaluateAvx2(int n, const uint32_t *ops, const int32_t *v1, const int32_t *v2, int32_t *results){
+  int i = 0;
+  const __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+  const __m256i three = _mm256_set1_epi32(3), four = _mm256_set1_epi32(4);
+  const __m256i zero = _mm256_setzero_si256();
+  for (; i + 8 <= n; i += 8) {
+    __m256i op = _mm256_loadu_si256((const __m256i*)(ops + i));
+    __m256i a = _mm256_loadu_si256((const __m256i*)(v1 + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(v2 + i));
+
+    __m256i add = _mm256_add_epi32(a, b);
+    __m256i sub = _mm256_sub_epi32(a, b);
+    __m256i mul = _mm256_mullo_epi32(a, b);
+    __m128i qlo = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(a)),
+                                                    _mm256_cvtepi32_pd(_mm256_castsi256_si128(b))));
+    __m128i qhi = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1)),
+                                                    _mm256_cvtepi32_pd(_mm256_extracti128_si256(b, 1))));
+    __m256i div = _mm256_inserti128_si256(_mm256_castsi128_si256(qlo), qhi, 1);
+    div = _mm256_andnot_si256(_mm256_cmpeq_epi32(b, zero), div);
+
+    __m256i r = _mm256_and_si256(add, _mm256_cmpeq_epi32(op, one));
+    r = _mm256_or_si256(r, _mm256_and_si256(sub, _mm256_cmpeq_epi32(op, two)));
+    r = _mm256_or_si256(r, _mm256_and_si256(mul, _mm256_cmpeq_epi32(op, three)));
+    r = _mm256_or_si256(r, _mm256_and_si256(div, _mm256_cmpeq_epi32(op, four)));
+    _mm256_storeu_si256((__m256i*)(results + i), r);
+  }
+  calcEvaluateScalar(n - i, ops + i, v1 + i, v2 + i, results + i);
+}
+
+__attribute__((target("sse4.1")))
+static void calcEvaluateSse41(int n, const uint32_t *ops, const int32_t *v1, const int32_t *v2, int32_t *results){
+  int i = 0;
+  const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+  const __m128i three = _mm_set1_epi32(3), four = _mm_set1_epi32(4);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 4 <= n; i += 4) {
+    __m128i op = _mm_loadu_si128((const __m128i*)(ops + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(v1 + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(v2 + i));
+
+    __m128i add = _mm_add_epi32(a, b);
+    __m128i sub = _mm_sub_epi32(a, b);
+    __m128i mul = _mm_mullo_epi32(a, b);
+    __m128i ahi = _mm_shuffle_epi32(a, 0x4e), bhi = _mm_shuffle_epi32(b, 0x4e);
+    __m128i qlo = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(a), _mm_cvtepi32_pd(b)));
+    __m128i qhi = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(ahi), _mm_cvtepi32_pd(bhi)));
+    __m128i div = _mm_unpacklo_epi64(qlo, qhi);
+    div = _mm_andnot_si128(_mm_cmpeq_epi32(b, zero), div);
+
+    __m128i r = _mm_and_si128(add, _mm_cmpeq_epi32(op, one));
+    r = _mm_or_si128(r, _mm_and_si128(sub, _mm_cmpeq_epi32(op, two)));
+    r = _mm_or_si128(r, _mm_and_si128(mul, _mm_cmpeq_epi32(op, three)));
+    r = _mm_or_si128(r, _mm_and_si128(div, _mm_cmpeq_epi32(op, four)));
+    _mm_storeu_si128((__m128i*)(results + i), r);
+  }
+  calcEvaluateScalar(n - i, ops + i, v1 + i, v2 + i, results + i);
+}
+#endif
+
+typedef void (*calcEvaluateFn)(int, const uint32_t*, const int32_t*, const int32_t*, int32_t*);
+
+static calcEvaluateFn calcEvaluateImpl;
+static int calcSimd = -1;
+
+/* Pick the widest kernel this CPU runs, once. Racing threads pick the same one. */
+static calcEvaluateFn calcEvaluatePick(void){
+  calcEvaluateFn fn = __atomic_load_n(&calcEvaluateImpl, __ATOMIC_ACQUIRE);
+  if (fn) return fn;
+  int level = 0;
+  fn = calcEvaluateScalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) { fn = calcEvaluateAvx2; level = 2; }
+  else if (__builtin_cpu_supports("sse4.1")) { fn = calcEvaluateSse41; level = 1; }
+#endif
+  __atomic_store_n(&calcSimd, level, __ATOMIC_RELAXED);
+  __atomic_store_n(&calcEvaluateImpl, fn, __ATOMIC_RELEASE);
+  return fn;
+}
+
+int calcSimdLevel(void){
+  calcEvaluatePick();
+  return __atomic_load_n(&calcSimd, __ATOMIC_RELAXED);
+}
+
+void calcEvaluateBatch(int n, const uint32_t *ops, const int32_t *v1, const int32_t *v2, int32_t *results){
+  calcEvaluatePick()(n, ops, v1, v2, results);
+}
+
+int calcVerifyBatch(int n, const uint32_t *ops, const int32_t *v1, const int32_t *v2,
+                    const int32_t *answers, uint8_t *ok){
+  int32_t expected[256];
+  int i, j, good = 0;
+  calcEvaluateFn fn = calcEvaluatePick();
+  /* Evaluate in stack sized chunks, then compare. */
+  for (i = 0; i < n; i += 256) {
+    int m = n - i < 256 ? n - i : 256;
+    fn(m, ops + i, v1 + i, v2 + i, expected);
+    for (j = 0; j < m; j++) {
+      uint8_t hit = expected[j] == answers[i + j];
+      if (ok) ok[i + j] = hit;
+      good += hit;
+    }
+  }
+  return good;
+}
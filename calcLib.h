@@ -20,12 +20,56 @@ Implementation in calcLib.c
 */
   
 
+#include <stdint.h>
+
   int initCalcLib(void); // Init internal variables to the library, if needed. 
   int initCalcLib_seed(unsigned int seed); // Init internal variables to the library, use <seed> for specific variable. 
 
   char* randomType(void); // Return a string to an mathematical operator
   int randomInt(void);// Return a random integer, between 0 and 100. 
 
+/*
+
+Reentrant generator. A calcRng is a xoshiro256** state; every thread also has
+its own default one (calcRngThread()), seeded from the value given to
+initCalcLib()/initCalcLib_seed() and a per-thread number, so threads never
+share state or a lock. randomInt()/randomType() draw from the calling thread's
+generator. Calling initCalcLib*() again reseeds every thread's generator on its
+next draw (e.g. in a freshly forked worker).
+
+*/
+
+  typedef struct calcRng { uint64_t s[4]; } calcRng;
+
+  void calcRngSeed(calcRng *rng, uint64_t seed); // Expand <seed> into a full state (splitmix64).
+  uint64_t calcRngNext(calcRng *rng); // Next 64 random bits.
+  uint32_t calcRngBounded(calcRng *rng, uint32_t bound); // Unbiased draw in [0, bound), bound > 0.
+  calcRng *calcRngThread(void); // The calling thread's default generator.
+
+  int calcRandomInt(calcRng *rng); // As randomInt(), from <rng>.
+  uint32_t calcRandomArith(calcRng *rng); // Operation code 1..4 (add, sub, mul, div), see protocol.h.
+
+  /* Fill n assignments in one call: ops[i] in 1..4, v1[i]/v2[i] as randomInt()
+     (v2[i] never 0 for a division) and ids[i] 32 random bits. Any array may be
+     NULL to skip it. */
+  void calcRandomBatch(calcRng *rng, int n, uint32_t *ops, int32_t *v1, int32_t *v2, uint32_t *ids);
+
+/*
+
+Evaluation. Results follow C int arithmetic with wrap-around; division
+truncates toward zero, x/0 gives 0 and INT_MIN/-1 gives INT_MIN instead of
+trapping. Op codes outside 1..4 give 0. The batch forms take structure-of-arrays
+input and run an AVX2 or SSE4.1 kernel when the CPU has one (chosen at runtime),
+a scalar loop otherwise.
+
+*/
+
+  int32_t calcEvaluate(uint32_t op, int32_t a, int32_t b); // One expected result.
+  void calcEvaluateBatch(int n, const uint32_t *ops, const int32_t *v1, const int32_t *v2, int32_t *results);
+  /* ok[i] = 1 where answers[i] is the expected result (ok may be NULL). Returns the number of correct answers. */
+  int calcVerifyBatch(int n, const uint32_t *ops, const int32_t *v1, const int32_t *v2, const int32_t *answers, uint8_t *ok);
+  int calcSimdLevel(void); // Kernel in use: 0 scalar, 1 SSE4.1, 2 AVX2.
+
 
 #endif
 
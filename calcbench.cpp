@@ -0,0 +1,472 @@
+// calcbench.cpp
+// Load generator for tcpserver/udpserver. Runs sessions of one protocol
+// variant against host:port from a single epoll loop, computes the
+// answers with calcLib and reports throughput, failures and latency
+// percentiles per phase.
+// Usage: calcbench [-p proto] [-c clients] [-r rate] [-d secs] [-T ms] host:port
+//
+// -p P  text-tcp (default), binary-tcp, text-udp or binary-udp.
+// -c N  sessions in flight at once (default 1).
+// -r R  open loop: start R sessions per second whether or not earlier
+//       ones have finished. A start that has to wait for a free client
+//       is timed from when it was due, so a stalled server shows up in
+//       the session latency instead of slowing the load down. Without
+//       -r every client starts its next session as soon as one ends.
+// -d S  run for S seconds (default 10).
+// -T MS give up on a session after MS milliseconds (default 5000).
+//
+// Phases: connect (TCP connect() until writable), assignment (connected,
+// or hello sent, until the assignment is in), verdict (answer sent until
+// the verdict is in) and session (start, or due time, until the verdict).
+// A TCP session the server turns away with "ERROR BUSY" counts as busy.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <charconv>
+#include <string_view>
+#include <vector>
+
+#include "reactor.h"
+#include "histogram.h"
+#include "textproto.h"
+#include "wirecodec.h"
+extern "C" {
+#include "calcLib.h"
+}
+
+enum Proto { TEXT_TCP, BINARY_TCP, TEXT_UDP, BINARY_UDP };
+static const char *const PROTO_NAMES[] = { "text-tcp", "binary-tcp", "text-udp", "binary-udp" };
+
+enum Phase { PH_CONNECT, PH_ASSIGNMENT, PH_VERDICT, PH_SESSION, PH_COUNT };
+static const char *const PHASE_NAMES[] = { "connect", "assignment", "verdict", "session" };
+
+static Proto proto = TEXT_TCP;
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static int64_t timeout_ns = 5000000000LL;
+
+static bool is_tcp() { return proto == TEXT_TCP || proto == BINARY_TCP; }
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct Totals {
+    Histogram phase[PH_COUNT];
+    uint64_t started, ok, rejected, busy, errors, timeouts;
+    Totals() : started(0), ok(0), rejected(0), busy(0), errors(0), timeouts(0) {}
+};
+
+// One client slot, running one session at a time. Sessions are only
+// started from the main loop, never from inside a dispatch, so a stale
+// event for a closed socket cannot reach the next session.
+class Session : public EventHandler {
+public:
+    enum State { IDLE, CONNECTING, GREETING, ASSIGNMENT, VERDICT, DRAIN };
+    enum Outcome { OK, REJECTED, BUSY, ERROR, TIMEOUT };
+
+    Session(Reactor &r, Totals &t) : reactor(r), totals(t), fd(-1), state(IDLE), in_len(0) {}
+    ~Session() { close_socket(); }
+
+    bool idle() const { return state == IDLE; }
+
+    void start(int64_t due, int64_t now) {
+        t_due = due;
+        t_phase = now;
+        deadline = now + timeout_ns;
+        in_len = 0;
+        totals.started++;
+        if (is_tcp()) {
+            fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) { finish(ERROR, now); return; }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (connect(fd, (struct sockaddr*)&server, server_len) < 0 && errno != EINPROGRESS) {
+                finish(ERROR, now);
+                return;
+            }
+            state = CONNECTING;
+            reactor.add(fd, EPOLLOUT, this);
+            return;
+        }
+        // UDP keeps its connected socket (and so its source port) across
+        // sessions; the server forgets the peer after every verdict.
+        if (fd < 0) {
+            fd = socket(server.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0 || connect(fd, (struct sockaddr*)&server, server_len) < 0 ||
+                reactor.add(fd, EPOLLIN, this) < 0) {
+                finish(ERROR, now);
+                return;
+            }
+        }
+        state = ASSIGNMENT;
+        if (proto == TEXT_UDP) {
+            send_all("TEXT UDP 1.1\n", 13, now);
+        } else {
+            calcMessage m;
+            m.type = 22;
+            m.message = 0;
+            m.protocol = 17;
+            m.major_version = 1;
+            m.minor_version = 1;
+            char buf[wire::CalcMessage::SIZE];
+            wire::CalcMessage::encode(buf, m);
+            send_all(buf, sizeof(buf), now);
+        }
+    }
+
+    void check_timeout(int64_t now) {
+        if (state == IDLE || now < deadline) return;
+        if (state == DRAIN) {
+            // The verdict is in; only the server's close is missing.
+            close_socket();
+            state = IDLE;
+            return;
+        }
+        finish(TIMEOUT, now);
+    }
+
+    void on_event(uint32_t events) {
+        int64_t now = now_ns();
+        if (state == CONNECTING) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) { finish(ERROR, now); return; }
+            totals.phase[PH_CONNECT].record(now - t_phase);
+            t_phase = now;
+            state = GREETING;
+            reactor.modify(fd, EPOLLIN, this);
+            return;
+        }
+        if (is_tcp()) read_stream(now);
+        else read_datagrams(now);
+    }
+
+private:
+    Session(const Session&);
+    Session& operator=(const Session&);
+
+    static const size_t IN_MAX = 1024;
+
+    void close_socket() {
+        if (fd < 0) return;
+        reactor.remove(fd);
+        close(fd);
+        fd = -1;
+    }
+
+    void finish(Outcome o, int64_t now) {
+        switch (o) {
+        case OK: totals.ok++; break;
+        case REJECTED: totals.rejected++; break;
+        case BUSY: totals.busy++; break;
+        case ERROR: totals.errors++; break;
+        case TIMEOUT: totals.timeouts++; break;
+        }
+        if (o == OK || o == REJECTED) {
+            totals.phase[PH_VERDICT].record(now - t_phase);
+            totals.phase[PH_SESSION].record(now - t_due);
+        }
+        if (is_tcp() && (o == OK || o == REJECTED)) {
+            // Let the server close first, so TIME_WAIT stays on its side
+            // and a long run does not use up our ephemeral ports.
+            state = DRAIN;
+            return;
+        }
+        if (is_tcp() || o == ERROR || o == TIMEOUT) close_socket();
+        state = IDLE;
+    }
+
+    void send_all(const char *p, size_t n, int64_t now) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w != (ssize_t)n) finish(ERROR, now);
+    }
+
+    void assignment_done(int64_t now) {
+        totals.phase[PH_ASSIGNMENT].record(now - t_phase);
+        t_phase = now;
+        state = VERDICT;
+    }
+
+    // "add 12 34" (TCP after "ASSIGNMENT:", UDP possibly followed by a
+    // stateless token to echo back). Sends "<result>[ token]\n".
+    void answer_text(std::string_view line, int64_t now) {
+        static const char *const ops[] = { "add", "sub", "mul", "div" };
+        std::string_view op, token;
+        int a, b;
+        uint32_t arith = 0;
+        if (!textproto::scan_word(line, op) || !textproto::scan_int(line, a) || !textproto::scan_int(line, b)) {
+            finish(ERROR, now);
+            return;
+        }
+        for (uint32_t i = 0; i < 4; ++i)
+            if (op == ops[i]) arith = i + 1;
+        if (arith == 0) { finish(ERROR, now); return; }
+        char out[128];
+        char *p = std::to_chars(out, out + 16, calcEvaluate(arith, a, b)).ptr;
+        if (textproto::scan_word(line, token) && token.size() < sizeof(out) - 20) {
+            *p++ = ' ';
+            memcpy(p, token.data(), token.size());
+            p += token.size();
+        }
+        *p++ = '\n';
+        assignment_done(now);
+        send_all(out, p - out, now);
+    }
+
+    void answer_binary(const char *frame, int64_t now) {
+        calcProtocol cp;
+        wire::CalcProtocol::decode(frame, cp);
+        cp.type = 2;
+        cp.inResult = (uint32_t)calcEvaluate(cp.arith, (int32_t)cp.inValue1, (int32_t)cp.inValue2);
+        char out[wire::CalcProtocol::SIZE];
+        wire::CalcProtocol::encode(out, cp);
+        assignment_done(now);
+        send_all(out, sizeof(out), now);
+    }
+
+    void binary_verdict(const char *frame, int64_t now) {
+        uint32_t m = wire::CalcMessage::get<&calcMessage::message>(frame);
+        finish(m == 1 ? OK : m == 2 ? REJECTED : ERROR, now);
+    }
+
+    void read_stream(int64_t now) {
+        bool closed = false;
+        for (;;) {
+            ssize_t r = read(fd, in + in_len, IN_MAX - in_len);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) closed = true;
+                break;
+            }
+            if (r == 0) { closed = true; break; }
+            in_len += r;
+            if (state == DRAIN) in_len = 0;
+            if (in_len == IN_MAX) { finish(ERROR, now); return; }
+        }
+        if (in_len > 0) step(now);
+        if (!closed) return;
+        // The server closes after the verdict, which may have come in
+        // with the close.
+        if (state == DRAIN) { close_socket(); state = IDLE; }
+        else if (state != IDLE) finish(ERROR, now);
+    }
+
+    // Take what the current state needs from the input; the server only
+    // sends more after our next message, so at most one step applies.
+    void step(int64_t now) {
+        std::string_view buf(in, in_len);
+        size_t used = 0;
+        if (state == GREETING) {
+            if (buf.substr(0, 11) == "ERROR BUSY\n") { finish(BUSY, now); return; }
+            size_t end = buf.find("\n\n");
+            if (end == std::string_view::npos) return;
+            used = end + 2;
+            state = ASSIGNMENT;
+            if (proto == TEXT_TCP) send_all("TEXT TCP 1.1 OK\n", 16, now);
+            else send_all("BINARY TCP 1.1 OK\n", 18, now);
+        } else if (state == ASSIGNMENT && proto == TEXT_TCP) {
+            size_t nl = buf.find('\n');
+            if (nl == std::string_view::npos) return;
+            used = nl + 1;
+            std::string_view line = buf.substr(0, nl);
+            if (line.substr(0, 11) != "ASSIGNMENT:") { finish(ERROR, now); return; }
+            answer_text(line.substr(11), now);
+        } else if (state == ASSIGNMENT) {
+            if (in_len < wire::CalcProtocol::SIZE) return;
+            used = wire::CalcProtocol::SIZE;
+            answer_binary(in, now);
+        } else if (state == VERDICT && proto == TEXT_TCP) {
+            size_t nl = buf.find('\n');
+            if (nl == std::string_view::npos) return;
+            used = nl + 1;
+            std::string_view line = buf.substr(0, nl);
+            finish(line.substr(0, 3) == "OK " ? OK : line.substr(0, 5) == "ERROR" ? REJECTED : ERROR, now);
+        } else if (state == VERDICT) {
+            if (in_len < wire::CalcMessage::SIZE) return;
+            used = wire::CalcMessage::SIZE;
+            binary_verdict(in, now);
+        }
+        memmove(in, in + used, in_len - used);
+        in_len -= used;
+    }
+
+    void read_datagrams(int64_t now) {
+        for (;;) {
+            ssize_t r = recv(fd, in, IN_MAX, 0);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK && state != IDLE) finish(ERROR, now);
+                return;
+            }
+            if (state == ASSIGNMENT && proto == TEXT_UDP) {
+                answer_text(textproto::trim_eol(std::string_view(in, r)), now);
+            } else if (state == ASSIGNMENT) {
+                if (r == (ssize_t)wire::CalcProtocol::SIZE) answer_binary(in, now);
+                else finish(ERROR, now);
+            } else if (state == VERDICT && proto == TEXT_UDP) {
+                std::string_view v = textproto::trim_eol(std::string_view(in, r));
+                finish(v == "OK" ? OK : v == "NOT OK" || v == "ERROR" ? REJECTED : ERROR, now);
+            } else if (state == VERDICT) {
+                if (r == (ssize_t)wire::CalcMessage::SIZE) binary_verdict(in, now);
+                else finish(ERROR, now);
+            }
+            // Anything else is a late reply to a session already given up.
+        }
+    }
+
+    Reactor &reactor;
+    Totals &totals;
+    int fd;
+    State state;
+    int64_t t_due;    // when the session was due to start
+    int64_t t_phase;  // start of the current phase
+    int64_t deadline;
+    char in[IN_MAX];
+    size_t in_len;
+};
+
+static int resolve(const char *input) {
+    const char *sep = strrchr(input, ':');
+    if (!sep || sep == input) {
+        fprintf(stderr, "Error: input must be host:port\n");
+        return -1;
+    }
+    std::string_view hostv(input, sep - input);
+    char host[256];
+    if (hostv.size() >= sizeof(host)) {
+        fprintf(stderr, "hostname too long\n");
+        return -1;
+    }
+    memcpy(host, hostv.data(), hostv.size());
+    host[hostv.size()] = '\0';
+    const char *h = host;
+    if (strcmp(host, "ip4-localhost") == 0) h = "127.0.0.1";
+    else if (strcmp(host, "ip6-localhost") == 0) h = "::1";
+
+    struct addrinfo hints{}, *res = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = is_tcp() ? SOCK_STREAM : SOCK_DGRAM;
+    int rc = getaddrinfo(h, sep + 1, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return -1;
+    }
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    server_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void report(const Totals &t, double secs, int clients, double rate, uint64_t missed) {
+    printf("calcbench: %s, %d clients, ", PROTO_NAMES[proto], clients);
+    if (rate > 0) printf("open loop at %.0f/s", rate);
+    else printf("closed loop");
+    printf(", %.1f s\n", secs);
+    uint64_t done = t.ok + t.rejected;
+    printf("sessions:   %llu started, %llu ok, %llu rejected, %llu busy, %llu errors, %llu timeouts\n",
+           (unsigned long long)t.started, (unsigned long long)t.ok, (unsigned long long)t.rejected,
+           (unsigned long long)t.busy, (unsigned long long)t.errors, (unsigned long long)t.timeouts);
+    if (rate > 0 && missed > 0)
+        printf("missed:     %llu starts still waiting for a free client at the end\n", (unsigned long long)missed);
+    printf("throughput: %.1f sessions/s\n", secs > 0 ? (double)done / secs : 0.0);
+    printf("%-12s %10s %10s %10s %10s %10s %10s %10s  (us)\n",
+           "phase", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < PH_COUNT; ++i) {
+        const Histogram &h = t.phase[i];
+        if (h.count() == 0) continue;
+        printf("%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", PHASE_NAMES[i],
+               (unsigned long long)h.count(), h.mean() / 1000.0, h.percentile(50) / 1000.0,
+               h.percentile(90) / 1000.0, h.percentile(99) / 1000.0, h.percentile(99.9) / 1000.0,
+               h.max() / 1000.0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int clients = 1;
+    double rate = 0;
+    double duration = 10;
+    int c;
+    while ((c = getopt(argc, argv, "p:c:r:d:T:")) != -1) {
+        switch (c) {
+        case 'p': {
+            int i = 0;
+            while (i < 4 && strcmp(optarg, PROTO_NAMES[i]) != 0) ++i;
+            if (i == 4) optind = argc;
+            else proto = (Proto)i;
+            break;
+        }
+        case 'c': clients = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'T': timeout_ns = atol(optarg) * 1000000LL; break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-p text-tcp|binary-tcp|text-udp|binary-udp] [-c clients] [-r rate] [-d secs] [-T ms] host:port\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (clients < 1) clients = 1;
+    if (timeout_ns <= 0) timeout_ns = 5000000000LL;
+    if (resolve(argv[optind]) < 0) return 1;
+
+    Reactor reactor;
+    if (!reactor.ok()) return 1;
+    Totals totals;
+    std::vector<Session*> sessions;
+    for (int i = 0; i < clients; ++i) sessions.push_back(new Session(reactor, totals));
+
+    int64_t start = now_ns();
+    int64_t end = start + (int64_t)(duration * 1e9);
+    int64_t interval = rate > 0 ? (int64_t)(1e9 / rate) : 0;
+    if (rate > 0 && interval < 1) interval = 1;
+    int64_t next_due = start;
+    int64_t now = start;
+    while (now < end) {
+        bool waiting = false;  // an idle client is waiting for the next due time
+        for (Session *s : sessions) {
+            if (!s->idle()) continue;
+            if (interval == 0) {
+                s->start(now, now);
+            } else if (next_due <= now) {
+                s->start(next_due, now);
+                next_due += interval;
+            } else {
+                waiting = true;
+                break;
+            }
+        }
+        int wait_ms = 10;
+        if (waiting) {
+            int64_t until = (next_due - now + 999999) / 1000000;
+            if (until < wait_ms) wait_ms = (int)until;
+        }
+        if (reactor.run_once(wait_ms) < 0) {
+            perror("epoll_wait");
+            break;
+        }
+        now = now_ns();
+        for (Session *s : sessions) s->check_timeout(now);
+    }
+
+    uint64_t missed = 0;
+    if (interval > 0 && next_due < now) missed = (uint64_t)((now - next_due) / interval);
+    report(totals, (now - start) / 1e9, clients, rate, missed);
+    for (Session *s : sessions) delete s;
+    return 0;
+}
@@ -0,0 +1,181 @@
+// calcservermain.cpp
+// Combined server: the TCP protocols (tcpsession.cpp) and the UDP ones
+// (udpengine.cpp) on the same port number, from one event loop per
+// worker thread. Each worker's Reactor carries its TCP listener, its
+// connections and their timer wheel (TcpWorker) as well as its UDP
+// socket and client expiry timer (UdpService). The assignment pool, the
+// generator, the verifier and the metrics shards are the ones the
+// separate servers use, shared by both transports.
+// Usage: calcserver [-t threads] [-b backlog] [-n batch] [-c clients] [-S [-k key]] [-U path] [-T n]
+//                   [-m sessions] [-M bytes] [-H rate[/burst]] [-L ms] host:port
+//
+// -t N  run N workers, each with its own SO_REUSEPORT listener and UDP
+//       socket (0 = one per online CPU). Default is a single worker.
+// -b N  TCP listen() backlog, default SOMAXCONN.
+// -n N  datagrams per recvmmsg/sendmmsg round (default 64).
+// -c N  pre-size each worker's UDP client table for N clients.
+// -S    UDP stateless mode, answers are verified from keyed cookies.
+// -k K  cookie key as 32 hex digits (implies -S), random otherwise.
+// -U P  serve metrics (metrics.h) on the Unix socket P.
+// -T N  trace one session in N to the log (log.h); UDP only without -S.
+// Admission control (admission.h), one per worker for both transports:
+// -m N  at most N TCP sessions open at once, over all workers.
+// -M N  UDP client state budget in bytes (K, M, G suffixes) over all
+//       workers, default 256M, 0 = none.
+// -H R  at most R new sessions per second from one source address per
+//       worker, TCP and UDP together, in bursts of R (or B with R/B).
+// -L N  shed new sessions while event loop rounds take over N ms or a
+//       socket queue is more than half full.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "tcpengine.h"
+#include "udpengine.h"
+#include "metrics.h"
+#include "log.h"
+#include "sockets.h"
+extern "C" {
+#include "calcLib.h"
+}
+
+struct WorkerConfig {
+    int batch;
+    size_t expected_clients;
+    bool stateless;
+    uint8_t cookie_key[16];
+    AdmissionConfig admission;  // per worker
+    SessionCap *session_cap;    // -m, NULL without
+};
+
+// One worker: both transports on the TcpWorker's reactor. Returns only on
+// a fatal error.
+static void serve(int listenfd, int udpfd, const WorkerConfig *cfg, int slot) {
+    Admission admission(cfg->admission);
+    if (cfg->session_cap) admission.share_cap(cfg->session_cap, slot);
+    TcpWorker tcp;
+    UdpWorker udp(cfg->batch, cfg->expected_clients);
+    if (cfg->admission.enabled()) tcp.admission = udp.admission = &admission;
+    if (tcp.start(listenfd) < 0) return;
+    if (cfg->stateless) udp.set_stateless(cfg->cookie_key);
+    UdpService service(&udp, cfg->batch);
+    if (service.attach(tcp.reactor, std::vector<int>(1, udpfd)) < 0) return;
+    for (;;) {
+        if (tcp.step() < 0) return;
+        service.after_dispatch();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = 1;
+    int backlog = SOMAXCONN;
+    long expected_clients = 65536;
+    const char *keyhex = NULL;
+    const char *metrics_path = NULL;
+    WorkerConfig cfg;
+    cfg.batch = 64;
+    cfg.stateless = false;
+    cfg.session_cap = NULL;
+    cfg.admission.udp_budget = (size_t)256 << 20;
+    int c;
+    while ((c = getopt(argc, argv, "t:b:n:c:Sk:U:T:m:M:H:L:")) != -1) {
+        switch (c) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'b': backlog = atoi(optarg); break;
+        case 'n': cfg.batch = atoi(optarg); break;
+        case 'c': expected_clients = atol(optarg); break;
+        case 'S': cfg.stateless = true; break;
+        case 'k': keyhex = optarg; cfg.stateless = true; break;
+        case 'U': metrics_path = optarg; break;
+        case 'T': logging::trace_every = (unsigned)atoi(optarg); break;
+        case 'm': cfg.admission.max_sessions = atol(optarg); break;
+        case 'M':
+            if (!parse_bytes(optarg, cfg.admission.udp_budget)) optind = argc;
+            break;
+        case 'H':
+            if (!parse_hello_rate(optarg, cfg.admission)) optind = argc;
+            break;
+        case 'L': cfg.admission.lag_ms = atoi(optarg); break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-t threads] [-b backlog] [-n batch] [-c clients] [-S [-k key]] [-U path] [-T n] [-m sessions] [-M bytes] [-H rate[/burst]] [-L ms] host:port\n", argv[0]);
+        return 1;
+    }
+    if (cfg.batch < 1 || cfg.batch > UdpWorker::MAX_BATCH) {
+        fprintf(stderr, "batch must be 1..%d\n", UdpWorker::MAX_BATCH);
+        return 1;
+    }
+    if (nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1) nthreads = 1;
+    }
+    if (backlog <= 0) backlog = SOMAXCONN;
+    cfg.admission = cfg.admission.per_worker(nthreads);
+    if (cfg.admission.max_sessions > 0) {
+        cfg.session_cap = SessionCap::create(cfg.admission.max_sessions, nthreads);
+        if (!cfg.session_cap) return 1;
+    }
+    if (expected_clients < 0) expected_clients = 0;
+    if (cfg.stateless) {
+        if (keyhex) {
+            if (!parse_cookie_key(keyhex, cfg.cookie_key)) {
+                fprintf(stderr, "-k wants 32 hex digits\n");
+                return 1;
+            }
+        } else if (getrandom(cfg.cookie_key, sizeof(cfg.cookie_key), 0) != (ssize_t)sizeof(cfg.cookie_key)) {
+            perror("getrandom");
+            return 1;
+        }
+        expected_clients = 0;
+    }
+    cfg.expected_clients = (size_t)expected_clients;
+    if (cfg.admission.udp_budget && ClientTable<ClientState>::bytes_for(cfg.expected_clients) >= cfg.admission.udp_budget)
+        fprintf(stderr, "warning: a table for -c %ld clients takes the whole -M budget, no hello will be admitted\n",
+                expected_clients);
+    initCalcLib();
+
+    char host[256];
+    char port[64];
+    if (!parse_hostport(argv[optind], host, sizeof(host), port, sizeof(port))) return 1;
+
+    bool reuseport = nthreads > 1;
+    std::vector<int> listeners, udpsocks;
+    for (int i = 0; i < nthreads; ++i) {
+        int listenfd = setup_listener(host, port, backlog, reuseport);
+        if (listenfd < 0) {
+            perror("setup_listener");
+            return 1;
+        }
+        int udpfd = setup_udp_socket(host, port, reuseport);
+        if (udpfd < 0) {
+            perror("setup_udp_socket");
+            return 1;
+        }
+        listeners.push_back(listenfd);
+        udpsocks.push_back(udpfd);
+    }
+    fprintf(stderr, "TCP and UDP server on %s:%s\n", host, port);
+
+    signal(SIGPIPE, SIG_IGN);
+    metrics::init();
+    if (metrics_path && metrics::serve(metrics_path) < 0) return 1;
+
+    // Worker 0 runs on the main thread.
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nthreads; ++i) threads.emplace_back(serve, listeners[i], udpsocks[i], &cfg, i);
+    serve(listeners[0], udpsocks[0], &cfg, 0);
+    // Workers only return on a fatal error.
+    for (auto &t : threads) t.join();
+    return 1;
+}
@@ -0,0 +1,204 @@
+// clienttable.h
+// Flat open-addressing table for per-peer UDP state. Keys are a compact
+// 18-byte address+port (IPv4 peers are stored IPv4-mapped), values live
+// inline in the slot array, collisions are resolved Robin Hood style with
+// linear probing and deletion shifts the following run back, so there
+// are no tombstones and no per-client allocation. Values must be
+// trivially copyable: slots move on insert, erase and rehash, so a
+// pointer returned by find()/insert() is only good until the next
+// insert() or erase().
+
+#ifndef CLIENTTABLE_H
+#define CLIENTTABLE_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+
+struct ClientAddr {
+    uint8_t addr[16]; // IPv6, or ::ffff:a.b.c.d
+    uint16_t port;    // network byte order, as received
+
+    bool operator==(const ClientAddr &o) const { return memcmp(this, &o, sizeof(*this)) == 0; }
+};
+
+static_assert(sizeof(ClientAddr) == 18, "ClientAddr must stay 18 bytes");
+
+static inline ClientAddr client_addr(const struct sockaddr_storage &ss) {
+    ClientAddr k;
+    memset(&k, 0, sizeof(k));
+    if (ss.ss_family == AF_INET) {
+        const struct sockaddr_in *a = (const struct sockaddr_in*)&ss;
+        k.addr[10] = k.addr[11] = 0xff;
+        memcpy(k.addr + 12, &a->sin_addr, 4);
+        k.port = a->sin_port;
+    } else if (ss.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *a = (const struct sockaddr_in6*)&ss;
+        memcpy(k.addr, &a->sin6_addr, 16);
+        k.port = a->sin6_port;
+    }
+    return k;
+}
+
+template <class V>
+class ClientTable {
+    static_assert(std::is_trivially_copyable<V>::value, "ClientTable values are moved with memcpy");
+
+public:
+    static const size_t MIN_CAPACITY = 16;
+
+    // seed keys the hash so peers cannot aim for one probe run.
+    explicit ClientTable(size_t expected = 0, uint64_t seed = 0)
+        : slots(NULL), mask(0), count(0), seed(seed) {
+        reserve(expected);
+    }
+    ~ClientTable() { free(slots); }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return mask + 1; }
+
+    // Make room for n entries without a rehash.
+    void reserve(size_t n) {
+        size_t cap = capacity_for(n);
+        if (slots && cap <= capacity()) return;
+        rehash(cap);
+    }
+
+    // Size of the slot array, now and once it holds n entries.
+    size_t bytes() const { return capacity() * sizeof(Slot); }
+    static size_t bytes_for(size_t n) { return capacity_for(n) * sizeof(Slot); }
+
+    V *find(const ClientAddr &k) {
+        size_t i = hash(k) & mask;
+        for (uint16_t d = 1; ; ++d, i = (i + 1) & mask) {
+            Slot &s = slots[i];
+            // A resident closer to its home than we would be means the
+            // key would have displaced it: it is not in the table.
+            if (s.dist < d) return NULL;
+            if (s.dist == d && s.key == k) return &s.value;
+        }
+    }
+
+    // Find k, or add it with a value-initialized V. *created tells which.
+    V *insert(const ClientAddr &k, bool *created = NULL) {
+        V *v = find(k);
+        if (created) *created = v == NULL;
+        if (v) return v;
+        if ((count + 1) * MAX_LOAD_DEN > capacity() * MAX_LOAD_NUM) rehash(capacity() * 2);
+        Slot s = Slot();
+        s.key = k;
+        s.dist = 1;
+        ++count;
+        return place(s, hash(k) & mask);
+    }
+
+    bool erase(const ClientAddr &k) {
+        V *v = find(k);
+        if (!v) return false;
+        erase_slot(slot_of(v));
+        return true;
+    }
+
+    // Remove the entry find()/insert() returned.
+    void erase(V *v) { erase_slot(slot_of(v)); }
+
+    // f(const ClientAddr&, V&) for every entry. f must not insert or erase.
+    template <class F> void for_each(F f) {
+        for (size_t i = 0; i <= mask; ++i)
+            if (slots[i].dist) f(slots[i].key, slots[i].value);
+    }
+
+private:
+    ClientTable(const ClientTable&);
+    ClientTable& operator=(const ClientTable&);
+
+    // 7/8 is comfortable for Robin Hood; probe runs stay short.
+    static const size_t MAX_LOAD_NUM = 7;
+    static const size_t MAX_LOAD_DEN = 8;
+
+    struct Slot {
+        ClientAddr key;
+        uint16_t dist; // probe distance + 1, 0 = empty
+        V value;
+    };
+
+    static size_t capacity_for(size_t n) {
+        size_t cap = MIN_CAPACITY;
+        while (cap * MAX_LOAD_NUM < n * MAX_LOAD_DEN) cap <<= 1;
+        return cap;
+    }
+
+    size_t hash(const ClientAddr &k) const {
+        uint64_t lo, hi;
+        memcpy(&lo, k.addr, 8);
+        memcpy(&hi, k.addr + 8, 8);
+        // One 64x64->128 multiply folds both halves (wyhash style mix).
+        uint64_t a = lo ^ seed ^ k.port ^ 0xa0761d6478bd642fULL;
+        uint64_t b = hi ^ (seed >> 1) ^ 0xe7037ed1a0b428dbULL;
+        unsigned __int128 m = (unsigned __int128)a * b;
+        return (size_t)((uint64_t)m ^ (uint64_t)(m >> 64));
+    }
+
+    size_t slot_of(V *v) const {
+        return ((char*)v - (char*)slots) / sizeof(Slot);
+    }
+
+    // Robin Hood insertion of s starting at its home slot i. Returns where
+    // the new key ended up.
+    V *place(Slot s, size_t i) {
+        V *result = NULL;
+        for (;;) {
+            Slot &cur = slots[i];
+            if (cur.dist == 0) {
+                cur = s;
+                return result ? result : &cur.value;
+            }
+            if (cur.dist < s.dist) {
+                Slot tmp = cur;
+                cur = s;
+                s = tmp;
+                if (!result) result = &cur.value;
+            }
+            ++s.dist;
+            i = (i + 1) & mask;
+        }
+    }
+
+    void erase_slot(size_t i) {
+        size_t j = (i + 1) & mask;
+        while (slots[j].dist > 1) {
+            slots[i] = slots[j];
+            --slots[i].dist;
+            i = j;
+            j = (j + 1) & mask;
+        }
+        slots[i].dist = 0;
+        --count;
+    }
+
+    void rehash(size_t cap) {
+        Slot *old = slots;
+        size_t old_cap = old ? capacity() : 0;
+        slots = (Slot*)calloc(cap, sizeof(Slot));
+        if (!slots) throw std::bad_alloc();
+        mask = cap - 1;
+        for (size_t i = 0; i < old_cap; ++i) {
+            if (!old[i].dist) continue;
+            Slot s = old[i];
+            s.dist = 1;
+            place(s, hash(s.key) & mask);
+        }
+        free(old);
+    }
+
+    Slot *slots;
+    size_t mask;
+    size_t count;
+    uint64_t seed;
+};
+
+#endif
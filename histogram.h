@@ -0,0 +1,97 @@
+// histogram.h
+// Log-linear latency histogram in the style of HdrHistogram: every power
+// of two range is split into 32 linear buckets, so any recorded value is
+// known to within 1/32 (about 3%) from 1 up to 2^63, in a fixed 15 KB
+// array. Recording is a count increment; histograms from several runs or
+// threads merge by adding counts.
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Bucket layout: values below 2 * SUB get a bucket each; above that,
+// bucket (shift + 1) * SUB + k holds [(SUB + k) << shift, (SUB + k + 1) << shift).
+template <int SUB_BITS> struct LogLinear {
+    static const int SUB = 1 << SUB_BITS;
+
+    // Buckets needed for values below 2^bits.
+    static constexpr int buckets(int bits) { return (bits - SUB_BITS + 1) * SUB; }
+
+    static int index(uint64_t v) {
+        if (v < 2 * SUB) return (int)v;
+        int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return (shift + 1) * SUB + (int)((v >> shift) - SUB);
+    }
+
+    // Largest value in bucket i.
+    static uint64_t upper(int i) {
+        if (i < 2 * SUB) return (uint64_t)i;
+        int shift = i / SUB - 1;
+        return (((uint64_t)(SUB + i % SUB) + 1) << shift) - 1;
+    }
+};
+
+class Histogram {
+public:
+    typedef LogLinear<5> Layout;
+    static const int BUCKETS = Layout::buckets(64);
+
+    Histogram() { reset(); }
+
+    void reset() {
+        memset(counts, 0, sizeof(counts));
+        total = 0;
+        sum = 0;
+        lo = UINT64_MAX;
+        hi = 0;
+    }
+
+    void record(uint64_t v) {
+        counts[Layout::index(v)]++;
+        total++;
+        sum += v;
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+    }
+
+    void merge(const Histogram &o) {
+        for (int i = 0; i < BUCKETS; ++i) counts[i] += o.counts[i];
+        total += o.total;
+        sum += o.sum;
+        if (o.lo < lo) lo = o.lo;
+        if (o.hi > hi) hi = o.hi;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? lo : 0; }
+    uint64_t max() const { return hi; }
+    double mean() const { return total ? (double)sum / (double)total : 0.0; }
+
+    // Smallest value v such that pct percent of the recorded values are
+    // <= v, reported as the top of its bucket (never above max()).
+    uint64_t percentile(double pct) const {
+        if (total == 0) return 0;
+        uint64_t want = (uint64_t)(pct / 100.0 * (double)total + 0.5);
+        if (want < 1) want = 1;
+        if (want > total) want = total;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= want) {
+                uint64_t top = Layout::upper(i);
+                return top < hi ? top : hi;
+            }
+        }
+        return hi;
+    }
+
+private:
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t lo, hi;
+};
+
+#endif
@@ -0,0 +1,119 @@
+// inbuf.h
+// Per-connection input buffer. Reads from the socket in large chunks and
+// hands out complete lines (or fixed size frames) as views into its own
+// storage, so a line costs one memchr instead of one read() per byte.
+// Bytes after the current message stay buffered, which covers clients
+// that pipeline the protocol selection and the answer in one segment.
+
+#ifndef INBUF_H
+#define INBUF_H
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_view>
+
+class InputBuffer {
+public:
+    static const size_t CHUNK = 4096;      // minimum free space per read()
+    static const size_t MAX_SIZE = 65536;  // longest line we are willing to hold
+
+    InputBuffer() : buf(NULL), cap(0), rd(0), wr(0), scan(0) {}
+    ~InputBuffer() { free(buf); }
+
+    size_t size() const { return wr - rd; }
+    bool empty() const { return rd == wr; }
+
+    // One read() into the free space. Returns what read() returned; fails
+    // with ENOBUFS once MAX_SIZE bytes are held without a complete message.
+    ssize_t fill(int fd) {
+        if (!reserve(CHUNK)) { errno = ENOBUFS; return -1; }
+        ssize_t r;
+        do {
+            r = read(fd, buf + wr, cap - wr);
+        } while (r < 0 && errno == EINTR);
+        if (r > 0) wr += r;
+        return r;
+    }
+
+    // Copy in bytes received elsewhere (e.g. a completion based engine).
+    bool append(const char *p, size_t n) {
+        if (!reserve(n)) return false;
+        memcpy(buf + wr, p, n);
+        wr += n;
+        return true;
+    }
+
+    // Next line without its '\n'. The view stays valid until the next
+    // fill()/append().
+    bool read_line(std::string_view &line) {
+        const char *nl = (const char*)memchr(buf + scan, '\n', wr - scan);
+        if (!nl) {
+            scan = wr; // do not rescan these bytes next time
+            return false;
+        }
+        size_t end = nl - buf;
+        line = std::string_view(buf + rd, end - rd);
+        rd = scan = end + 1;
+        reset_if_empty();
+        return true;
+    }
+
+    // Next n bytes as one frame (what full_read() used to collect).
+    bool take(size_t n, const char *&p) {
+        if (size() < n) return false;
+        p = buf + rd;
+        rd += n;
+        if (scan < rd) scan = rd;
+        reset_if_empty();
+        return true;
+    }
+
+    void clear() { rd = wr = scan = 0; }
+
+    // Give the memory back once the connection no longer reads.
+    void release() {
+        free(buf);
+        buf = NULL;
+        cap = rd = wr = scan = 0;
+    }
+
+private:
+    InputBuffer(const InputBuffer&);
+    InputBuffer& operator=(const InputBuffer&);
+
+    void reset_if_empty() {
+        // Views handed out point at rd..; only rewind when nothing is left,
+        // so they stay valid until the next fill().
+        if (rd == wr) rd = wr = scan = 0;
+    }
+
+    bool reserve(size_t n) {
+        if (cap - wr >= n) return true;
+        // Slide the unread bytes to the front before growing.
+        if (rd > 0) {
+            memmove(buf, buf + rd, wr - rd);
+            wr -= rd;
+            scan -= rd;
+            rd = 0;
+            if (cap - wr >= n) return true;
+        }
+        size_t ncap = cap ? cap : CHUNK;
+        while (ncap - wr < n) ncap *= 2;
+        if (ncap > MAX_SIZE + CHUNK) return false;
+        char *nb = (char*)realloc(buf, ncap);
+        if (!nb) return false;
+        buf = nb;
+        cap = ncap;
+        return true;
+    }
+
+    char *buf;
+    size_t cap;
+    size_t rd, wr; // unread bytes are buf[rd..wr)
+    size_t scan;   // bytes before this hold no '\n'
+};
+
+#endif
@@ -0,0 +1,274 @@
+// log.cpp
+// Per-thread record rings and the formatter thread, see log.h
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mutex>
+#include <thread>
+
+#include "log.h"
+
+namespace logging {
+
+Level min_level = INFO;
+unsigned trace_every = 0;
+
+static const uint32_t RING_SIZE = 1024;  // records, a power of two
+
+struct Record {
+    Site *site;
+    int64_t ts_ns;  // CLOCK_REALTIME_COARSE
+    int32_t err;
+    uint32_t suppressed;
+    int64_t args[MAX_ARGS];
+};
+
+// Single producer (the owning thread), single consumer (whoever holds
+// drain_lock). Rings are never freed: a thread's ring is left orphaned
+// when it exits and the next new thread adopts it once it is drained.
+struct Ring {
+    Record recs[RING_SIZE];
+    alignas(64) std::atomic<uint32_t> head{0};  // producer
+    std::atomic<uint64_t> dropped{0};
+    alignas(64) std::atomic<uint32_t> tail{0};  // consumer
+    uint64_t reported = 0;                      // drops already reported, consumer
+    std::atomic<bool> orphan{false};
+    int32_t tid = 0;
+    Ring *next = NULL;
+};
+
+static std::atomic<Ring*> rings{NULL};
+static std::atomic<bool> writer_started{false};
+// The writer sleeps on wake_seq (a futex) while every ring is empty.
+// emit() bumps it when it finds the writer caught up with its ring, and
+// makes the syscall only if the writer is asleep.
+static std::atomic<uint32_t> wake_seq{0};
+static std::atomic<bool> writer_waiting{false};
+static const time_t WRITER_FALLBACK_SEC = 1;
+static std::mutex drain_lock;
+static thread_local Ring *tls_ring = NULL;
+
+// Marks the thread's ring orphaned when the thread exits. Only touched
+// in attach(), so emit() reads tls_ring without the TLS init check.
+struct RingOwner {
+    bool armed = false;
+    ~RingOwner() {
+        if (armed && tls_ring) tls_ring->orphan.store(true, std::memory_order_release);
+    }
+};
+static thread_local RingOwner tls_owner;
+
+static const char *const LEVEL_NAMES[] = { "trace", "debug", "info", "warn", "error" };
+
+static void write_all(const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(2, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        p += w;
+        n -= w;
+    }
+}
+
+static size_t format(char *out, size_t cap, const Ring *r, const Record &rec) {
+    time_t sec = (time_t)(rec.ts_ns / 1000000000);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    size_t n = strftime(out, cap, "ts=%Y-%m-%dT%H:%M:%S", &tm);
+    const Site *s = rec.site;
+    const char *file = strrchr(s->file, '/');
+    file = file ? file + 1 : s->file;
+    n += snprintf(out + n, cap - n, ".%03dZ level=%s tid=%d src=%s:%d msg=\"", (int)(rec.ts_ns / 1000000 % 1000),
+                  LEVEL_NAMES[s->level], (int)r->tid, file, s->line);
+    int arg = 0;
+    for (const char *f = s->fmt; *f && n < cap - 1; ++f) {
+        if (f[0] == '{' && f[1] == '}' && arg < MAX_ARGS) {
+            n += snprintf(out + n, cap - n, "%lld", (long long)rec.args[arg++]);
+            ++f;
+        } else {
+            out[n++] = *f == '"' ? '\'' : *f;
+        }
+    }
+    if (n < cap && rec.err) {
+        char buf[128];
+        n += snprintf(out + n, cap - n, ": %s", strerror_r(rec.err, buf, sizeof(buf)));
+    }
+    if (n < cap) n += snprintf(out + n, cap - n, "\"");
+    if (n < cap && rec.suppressed) n += snprintf(out + n, cap - n, " suppressed=%u", rec.suppressed);
+    if (n >= cap - 1) n = cap - 2;
+    out[n++] = '\n';
+    return n;
+}
+
+// Formats and writes everything queued. Returns the number of records.
+static size_t drain() {
+    std::lock_guard<std::mutex> g(drain_lock);
+    static char buf[65536];
+    size_t used = 0, count = 0;
+    for (Ring *r = rings.load(std::memory_order_acquire); r; r = r->next) {
+        uint64_t dropped = r->dropped.load(std::memory_order_relaxed);
+        // seq_cst, against emit()'s store of head and load of tail: one
+        // side always sees the other, so no record is left unannounced.
+        uint32_t head = r->head.load();
+        uint32_t tail = r->tail.load(std::memory_order_relaxed);
+        for (; tail != head; ++tail) {
+            if (sizeof(buf) - used < 1024) {
+                write_all(buf, used);
+                used = 0;
+            }
+            used += format(buf + used, 1024, r, r->recs[tail % RING_SIZE]);
+            count++;
+        }
+        r->tail.store(tail);
+        if (dropped != r->reported) {
+            if (sizeof(buf) - used < 1024) {
+                write_all(buf, used);
+                used = 0;
+            }
+            used += snprintf(buf + used, sizeof(buf) - used,
+                             "level=warn tid=%d msg=\"log ring full\" dropped=%llu\n", (int)r->tid,
+                             (unsigned long long)(dropped - r->reported));
+            r->reported = dropped;
+        }
+    }
+    write_all(buf, used);
+    return count;
+}
+
+void flush() { drain(); }
+
+static void writer() {
+    for (;;) {
+        uint32_t seq = wake_seq.load();
+        if (drain() > 0) continue;
+        writer_waiting.store(true);
+        struct timespec ts = { WRITER_FALLBACK_SEC, 0 };
+        syscall(SYS_futex, (uint32_t*)&wake_seq, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+        writer_waiting.store(false);
+    }
+}
+
+static void start_writer() {
+    // Started with every signal blocked, so it never takes one meant for
+    // the server threads.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    std::thread(writer).detach();
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// The child of a fork has only the forking thread: every other ring is an
+// orphan, and what is queued is the parent's to write. The writer did not
+// survive the fork either; the forking thread keeps its ring, so emit()
+// would never attach() again and it has to be restarted here.
+static void fork_prepare() { drain_lock.lock(); }
+static void fork_parent() { drain_lock.unlock(); }
+static void fork_child() {
+    for (Ring *r = rings.load(std::memory_order_relaxed); r; r = r->next) {
+        r->tail.store(r->head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        r->reported = r->dropped.load(std::memory_order_relaxed);
+        r->orphan.store(r != tls_ring, std::memory_order_relaxed);
+    }
+    if (tls_ring) tls_ring->tid = (int32_t)syscall(SYS_gettid);
+    drain_lock.unlock();
+    start_writer();
+}
+
+static Ring *attach() {
+    if (!writer_started.exchange(true)) {
+        static std::once_flag once;
+        std::call_once(once, []() {
+            pthread_atfork(fork_prepare, fork_parent, fork_child);
+            atexit(flush);
+        });
+        start_writer();
+    }
+    tls_owner.armed = true;
+    int32_t me = (int32_t)syscall(SYS_gettid);
+    for (Ring *r = rings.load(std::memory_order_acquire); r; r = r->next) {
+        bool orphan = true;
+        if (r->orphan.load(std::memory_order_acquire) &&
+            r->head.load(std::memory_order_relaxed) == r->tail.load(std::memory_order_acquire) &&
+            r->orphan.compare_exchange_strong(orphan, false)) {
+            r->tid = me;
+            return tls_ring = r;
+        }
+    }
+    Ring *r = new Ring;
+    r->tid = me;
+    Ring *first = rings.load(std::memory_order_relaxed);
+    do {
+        r->next = first;
+    } while (!rings.compare_exchange_weak(first, r, std::memory_order_release, std::memory_order_relaxed));
+    return tls_ring = r;
+}
+
+void emit(Site *site, int err, const int64_t *args, int nargs) {
+    int saved = errno;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    uint32_t suppressed = 0;
+    if (site->level != TRACE) {
+        // Racy between threads on the same site, which only makes the
+        // limit approximate.
+        if (site->window.load(std::memory_order_relaxed) != ts.tv_sec) {
+            site->window.store(ts.tv_sec, std::memory_order_relaxed);
+            site->count.store(0, std::memory_order_relaxed);
+        }
+        if (site->count.fetch_add(1, std::memory_order_relaxed) >= RATE_PER_SEC) {
+            site->suppressed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (site->suppressed.load(std::memory_order_relaxed))
+            suppressed = site->suppressed.exchange(0, std::memory_order_relaxed);
+    }
+    Ring *r = tls_ring ? tls_ring : attach();
+    uint32_t head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) >= RING_SIZE) {
+        r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        errno = saved;
+        return;
+    }
+    Record &rec = r->recs[head % RING_SIZE];
+    rec.site = site;
+    rec.ts_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec.err = err;
+    rec.suppressed = suppressed;
+    for (int i = 0; i < nargs; ++i) rec.args[i] = args[i];
+    r->head.store(head + 1);
+    // The writer has taken everything before this record: it may be
+    // going to sleep, tell it.
+    if (r->tail.load() == head) {
+        wake_seq.fetch_add(1);
+        if (writer_waiting.load()) syscall(SYS_futex, (uint32_t*)&wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    errno = saved;
+}
+
+uint32_t sample_session() {
+    if (!trace_every) return 0;
+    static thread_local unsigned n = 0;
+    if (++n < trace_every) return 0;
+    n = 0;
+    static std::atomic<uint32_t> next_id{0};
+    uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed) + 1;
+    return id ? id : 1;
+}
+
+uint64_t dropped() {
+    uint64_t total = 0;
+    for (Ring *r = rings.load(std::memory_order_acquire); r; r = r->next)
+        total += r->dropped.load(std::memory_order_relaxed);
+    return total;
+}
+
+}
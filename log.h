@@ -0,0 +1,92 @@
+// log.h
+// Asynchronous logging for the server loops. A LOG_* call copies a fixed
+// size binary record (call site, time, errno, up to four integers) into
+// its thread's ring and returns; nothing is formatted and no lock is
+// taken. A background thread drains the rings, formats the records as
+// logfmt lines and writes them to stderr, so a slow pipe or journald
+// stalls only that thread. It sleeps while the rings are empty and is
+// woken by the first record after it caught up, so an idle server does
+// not wake for it. A full ring drops the record and counts it, and the
+// formatter reports the count.
+//
+// Each call site is a static Site holding the message, its level and a
+// rate limit: past RATE_PER_SEC records in one second the site only
+// counts, and the next record it lets through carries the number
+// suppressed.
+//
+// Tracing: with trace_every set to N, one session in N is traced
+// (sample_session() hands it a non-zero id) and its LOG_TRACE calls are
+// recorded whatever the level. An untraced session pays one branch.
+//
+//   LOG_WARN_ERRNO("accept");                // msg="accept: <strerror(errno)>"
+//   LOG_WARN("worker {} died (status {})", pid, status);
+//   LOG_TRACE(trace, "tcp session {} verdict {}", trace, ok);
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <atomic>
+
+namespace logging {
+
+enum Level { TRACE, DEBUG, INFO, WARN, ERROR };
+
+static const int MAX_ARGS = 4;
+static const uint32_t RATE_PER_SEC = 20;
+
+struct Site {
+    Level level;
+    const char *fmt;  // "{}" is replaced by the next argument
+    const char *file;
+    int line;
+    // Rate limit, shared by every thread logging from the site.
+    std::atomic<int64_t> window;  // second the count is for
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> suppressed;
+};
+
+extern Level min_level;       // INFO unless changed before the threads start
+extern unsigned trace_every;  // 0: no tracing
+
+void emit(Site *site, int err, const int64_t *args, int nargs);
+
+template <class... A> inline void log(Site *site, int err, A... a) {
+    static_assert(sizeof...(A) <= MAX_ARGS, "too many log arguments");
+    int64_t args[sizeof...(A) + 1] = { (int64_t)a... };
+    emit(site, err, args, (int)sizeof...(A));
+}
+
+// Non-zero trace id for one session in trace_every.
+uint32_t sample_session();
+
+// Write out whatever is queued, from the calling thread. Runs at exit;
+// call it before _exit().
+void flush();
+
+// Records dropped on full rings, over all threads.
+uint64_t dropped();
+
+}
+
+#define LOG_AT(lvl, err, fmt, ...) do {                                              \
+        static logging::Site log_site_ = { lvl, fmt, __FILE__, __LINE__, {}, {}, {} }; \
+        if (lvl >= logging::min_level) logging::log(&log_site_, err, ##__VA_ARGS__);   \
+    } while (0)
+
+#define LOG_ERROR(fmt, ...) LOG_AT(logging::ERROR, 0, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(logging::WARN, 0, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(logging::INFO, 0, fmt, ##__VA_ARGS__)
+#define LOG_ERROR_ERRNO(fmt, ...) LOG_AT(logging::ERROR, errno, fmt, ##__VA_ARGS__)
+#define LOG_WARN_ERRNO(fmt, ...) LOG_AT(logging::WARN, errno, fmt, ##__VA_ARGS__)
+
+// id is the session's sample_session() value; 0 records nothing.
+#define LOG_TRACE(id, fmt, ...) do {                                                           \
+        if (id) {                                                                              \
+            static logging::Site log_site_ = { logging::TRACE, fmt, __FILE__, __LINE__, {}, {}, {} }; \
+            logging::log(&log_site_, 0, ##__VA_ARGS__);                                        \
+        }                                                                                      \
+    } while (0)
+
+#endif
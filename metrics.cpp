@@ -0,0 +1,249 @@
+// metrics.cpp
+// Shared shards and the Prometheus exporter, see metrics.h
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <thread>
+
+#include "metrics.h"
+#include "log.h"
+
+namespace metrics {
+
+static const int MAX_SHARDS = 256;
+
+struct Region {
+    std::atomic<int32_t> owner[MAX_SHARDS];  // tid of the writer, 0 = never used
+    Shard shards[MAX_SHARDS];
+};
+
+static const char *const VARIANT_NAMES[] = { "none", "text_tcp", "binary_tcp", "text_tcp_stream",
+                                             "binary_tcp_stream", "text_udp", "binary_udp" };
+static const char *const VERDICT_NAMES[] = { "ok", "not_ok", "error", "error_to" };
+static const char *const TRANSPORT_NAMES[] = { "tcp", "udp" };
+static const char *const REJECT_NAMES[] = { "cap", "rate", "memory", "shed" };
+
+static Region *region = NULL;
+static Shard spare;  // threads without a shared shard
+thread_local Shard *tls_shard = NULL;
+
+// A forked child is a new writer and needs a shard of its own.
+static void forget_shard() { tls_shard = NULL; }
+
+bool init() {
+    if (region) return true;
+    // Fresh anonymous memory is zero, which is what every field starts
+    // at; only the shards that get claimed are ever touched.
+    void *p = mmap(NULL, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap(metrics)");
+        return false;
+    }
+    region = new (p) Region;
+    pthread_atfork(NULL, NULL, forget_shard);
+    return true;
+}
+
+static bool alive(int32_t tid) {
+    return kill(tid, 0) == 0 || errno != ESRCH;
+}
+
+Shard *claim() {
+    if (!region) return tls_shard = &spare;
+    int32_t me = (int32_t)syscall(SYS_gettid);
+    // First one whose writer has died, so a respawned worker takes over
+    // its predecessor's, then one nobody used yet.
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < MAX_SHARDS; ++i) {
+            int32_t cur = region->owner[i].load(std::memory_order_acquire);
+            if (pass == 0 ? (cur == 0 || alive(cur)) : cur != 0) continue;
+            if (!region->owner[i].compare_exchange_strong(cur, me, std::memory_order_acq_rel)) continue;
+            Shard *s = &region->shards[i];
+            // Counters keep adding up; gauges described the dead writer.
+            s->tcp_active.set(0);
+            s->udp_clients.set(0);
+            s->shedding.set(0);
+            return tls_shard = s;
+        }
+    }
+    LOG_WARN("metrics: all {} shards in use", MAX_SHARDS);
+    return tls_shard = &spare;
+}
+
+static void append(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void append(std::string &out, const char *fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n > 0) out.append(line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+}
+
+static void header(std::string &out, const char *name, const char *type, const char *help) {
+    append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+std::string render() {
+    static Shard sum;  // only the exporter thread renders
+    memset((void*)&sum, 0, sizeof(sum));
+    int in_use = 0;
+    if (region) {
+        for (int i = 0; i < MAX_SHARDS; ++i) {
+            int32_t owner = region->owner[i].load(std::memory_order_acquire);
+            if (owner == 0) continue;
+            bool live = alive(owner);
+            if (live) in_use++;
+            const Shard &s = region->shards[i];
+            for (int v = 0; v < VARIANTS; ++v) {
+                sum.started[v].add(s.started[v].get());
+                sum.completed[v].add(s.completed[v].get());
+                for (int d = 0; d < VERDICTS; ++d) sum.verdicts[v][d].add(s.verdicts[v][d].get());
+                sum.answer_count[v].add(s.answer_count[v].get());
+                sum.answer_sum_us[v].add(s.answer_sum_us[v].get());
+                for (int b = 0; b < ANSWER_BUCKETS; ++b) sum.answer_buckets[v][b].add(s.answer_buckets[v][b].get());
+            }
+            sum.tcp_accepted.add(s.tcp_accepted.get());
+            for (int t = 0; t < TRANSPORTS; ++t)
+                for (int r = 0; r < REJECTS; ++r) sum.rejected[t][r].add(s.rejected[t][r].get());
+            // A dead writer's counters still count, its gauges no longer
+            // describe anything.
+            if (!live) continue;
+            sum.tcp_active.add(s.tcp_active.get());
+            sum.udp_clients.add(s.udp_clients.get());
+            sum.shedding.add(s.shedding.get());
+        }
+    }
+
+    std::string out;
+    header(out, "calc_sessions_started_total", "counter", "Sessions that chose a protocol variant.");
+    for (int v = NONE + 1; v < VARIANTS; ++v)
+        append(out, "calc_sessions_started_total{variant=\"%s\"} %llu\n", VARIANT_NAMES[v],
+               (unsigned long long)sum.started[v].get());
+    header(out, "calc_sessions_completed_total", "counter",
+           "Sessions that got their verdict (1.2: that the client closed).");
+    for (int v = NONE + 1; v < VARIANTS; ++v)
+        append(out, "calc_sessions_completed_total{variant=\"%s\"} %llu\n", VARIANT_NAMES[v],
+               (unsigned long long)sum.completed[v].get());
+    header(out, "calc_verdicts_total", "counter", "Verdicts sent, by variant (none: before one was chosen).");
+    for (int v = 0; v < VARIANTS; ++v)
+        for (int d = 0; d < VERDICTS; ++d)
+            append(out, "calc_verdicts_total{variant=\"%s\",verdict=\"%s\"} %llu\n", VARIANT_NAMES[v],
+                   VERDICT_NAMES[d], (unsigned long long)sum.verdicts[v][d].get());
+    header(out, "calc_tcp_connections_accepted_total", "counter", "TCP connections accepted.");
+    append(out, "calc_tcp_connections_accepted_total %llu\n", (unsigned long long)sum.tcp_accepted.get());
+    header(out, "calc_tcp_connections_active", "gauge", "TCP connections open.");
+    append(out, "calc_tcp_connections_active %lld\n", (long long)sum.tcp_active.get());
+    header(out, "calc_udp_clients", "gauge", "Entries in the UDP client tables.");
+    append(out, "calc_udp_clients %lld\n", (long long)sum.udp_clients.get());
+    header(out, "calc_admission_rejected_total", "counter", "New sessions refused by admission control, by reason.");
+    for (int t = 0; t < TRANSPORTS; ++t)
+        for (int r = 0; r < REJECTS; ++r)
+            append(out, "calc_admission_rejected_total{transport=\"%s\",reason=\"%s\"} %llu\n", TRANSPORT_NAMES[t],
+                   REJECT_NAMES[r], (unsigned long long)sum.rejected[t][r].get());
+    header(out, "calc_admission_shedding", "gauge", "Workers shedding new sessions because they are overloaded.");
+    append(out, "calc_admission_shedding %lld\n", (long long)sum.shedding.get());
+
+    // Recorded with four buckets per power of two, exported per power of two.
+    header(out, "calc_answer_seconds", "histogram", "Time from sending an assignment to reading its answer.");
+    for (int v = NONE + 1; v < VARIANTS; ++v) {
+        uint64_t cum = 0;
+        for (int b = 0; b < ANSWER_BUCKETS; ++b) {
+            cum += sum.answer_buckets[v][b].get();
+            if (b % AnswerLayout::SUB != AnswerLayout::SUB - 1) continue;
+            append(out, "calc_answer_seconds_bucket{variant=\"%s\",le=\"%.6f\"} %llu\n", VARIANT_NAMES[v],
+                   (double)(AnswerLayout::upper(b) + 1) / 1e6, (unsigned long long)cum);
+        }
+        append(out, "calc_answer_seconds_bucket{variant=\"%s\",le=\"+Inf\"} %llu\n", VARIANT_NAMES[v],
+               (unsigned long long)sum.answer_count[v].get());
+        append(out, "calc_answer_seconds_sum{variant=\"%s\"} %.6f\n", VARIANT_NAMES[v],
+               (double)sum.answer_sum_us[v].get() / 1e6);
+        append(out, "calc_answer_seconds_count{variant=\"%s\"} %llu\n", VARIANT_NAMES[v],
+               (unsigned long long)sum.answer_count[v].get());
+    }
+    header(out, "calc_metrics_writers", "gauge", "Threads and processes with a live metrics shard.");
+    append(out, "calc_metrics_writers %d\n", in_use);
+    return out;
+}
+
+// One scrape: wait briefly for a request line, which only tells an HTTP
+// GET (gets a response header) from anything else, then send and close.
+static void answer(int c) {
+    char req[512];
+    size_t n = 0;
+    struct pollfd p = { c, POLLIN, 0 };
+    while (n < sizeof(req) && poll(&p, 1, 200) > 0) {
+        ssize_t r = read(c, req + n, sizeof(req) - n);
+        if (r <= 0) break;
+        n += r;
+        if (memchr(req, '\n', n)) break;
+    }
+    std::string body = render();
+    std::string out;
+    if (n >= 4 && memcmp(req, "GET ", 4) == 0) {
+        append(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+    }
+    out += body;
+    size_t off = 0;
+    while (off < out.size()) {
+        ssize_t w = send(c, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        off += w;
+    }
+}
+
+int serve(const char *path) {
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "metrics socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket(AF_UNIX)");
+        return -1;
+    }
+    unlink(path);  // a leftover from an earlier run
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("metrics socket");
+        close(fd);
+        return -1;
+    }
+    // The thread starts with every signal blocked, so it never takes one
+    // meant for the main thread (the -P master reads SIGCHLD from a signalfd).
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    std::thread([fd]() {
+        for (;;) {
+            int c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+            if (c < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                LOG_ERROR_ERRNO("metrics accept");
+                return;
+            }
+            answer(c);
+            close(c);
+        }
+    }).detach();
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+}
@@ -0,0 +1,122 @@
+// metrics.h
+// Server metrics. Every worker thread (or -P worker process) records into
+// its own shard: counters, gauges and answer time histograms that only it
+// writes, so recording is a relaxed load and store on a cache line no
+// other writer touches, with no locked instruction. All shards sit in one
+// MAP_SHARED mapping made by init() before any thread or fork, so the -P
+// master sees what its workers record. A shard whose owner has died is
+// handed to the next worker that asks, counts and all, so totals survive
+// worker restarts. serve() sums the shards on demand and answers on a
+// Unix socket in Prometheus text format, to a plain "STATS" line or an
+// HTTP GET (curl --unix-socket).
+//
+// Verdicts: OK a correct answer, NOT_OK a wrong one (TCP "ERROR", UDP
+// "NOT OK"), ERROR a protocol error (bad selection, malformed or
+// unexpected message), ERROR_TO a TCP timeout. Answer times run from the
+// assignment being queued to the answer being parsed; the stateless UDP
+// mode keeps no state to time them from.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+#include "histogram.h"
+
+namespace metrics {
+
+enum Variant { NONE, TEXT_TCP, BINARY_TCP, TEXT_TCP_STREAM, BINARY_TCP_STREAM,
+               TEXT_UDP, BINARY_UDP, VARIANTS };
+enum Verdict { OK, NOT_OK, ERROR, ERROR_TO, VERDICTS };
+// Why admission control (admission.h) refused a new session.
+enum Transport { TCP, UDP, TRANSPORTS };
+enum Reject { REJECT_CAP, REJECT_RATE, REJECT_MEMORY, REJECT_SHED, REJECTS };
+
+// Written by the shard's owner only.
+struct Counter {
+    std::atomic<uint64_t> v;
+    void add(uint64_t n = 1) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+};
+
+struct Gauge {
+    std::atomic<int64_t> v;
+    void add(int64_t n) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void set(int64_t n) { v.store(n, std::memory_order_relaxed); }
+    int64_t get() const { return v.load(std::memory_order_relaxed); }
+};
+
+// Answer times in microseconds, four buckets per power of two up to
+// 2^32 us (71 minutes); longer ones land in the last bucket.
+typedef LogLinear<2> AnswerLayout;
+static const int ANSWER_BUCKETS = AnswerLayout::buckets(32);
+
+struct alignas(64) Shard {
+    Counter started[VARIANTS];
+    Counter completed[VARIANTS];
+    Counter verdicts[VARIANTS][VERDICTS];
+    Counter tcp_accepted;
+    Gauge tcp_active;
+    Gauge udp_clients;
+    Counter rejected[TRANSPORTS][REJECTS];
+    Gauge shedding;  // 1 while the writer sheds new sessions
+    Counter answer_count[VARIANTS];
+    Counter answer_sum_us[VARIANTS];
+    Counter answer_buckets[VARIANTS][ANSWER_BUCKETS];
+};
+
+// Map the shared shards. Call once, before starting threads or forking.
+// Without it recording still works, into a per-process shard nobody reads.
+bool init();
+
+// Start a thread answering on the Unix socket at path. Returns -1 on error.
+int serve(const char *path);
+
+// The Prometheus text exposition of all shards.
+std::string render();
+
+extern thread_local Shard *tls_shard;
+Shard *claim();
+
+inline Shard *local() {
+    Shard *s = tls_shard;
+    return s ? s : claim();
+}
+
+inline int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline void session_started(Variant v) { local()->started[v].add(); }
+inline void session_completed(Variant v) { local()->completed[v].add(); }
+inline void verdict(Variant v, Verdict d) { local()->verdicts[v][d].add(); }
+
+inline void tcp_opened() {
+    Shard *s = local();
+    s->tcp_accepted.add();
+    s->tcp_active.add(1);
+}
+inline void tcp_closed() { local()->tcp_active.add(-1); }
+inline void udp_clients(size_t n) { local()->udp_clients.set((int64_t)n); }
+inline void rejected(Transport t, Reject r) { local()->rejected[t][r].add(); }
+inline void shedding(bool on) { local()->shedding.set(on ? 1 : 0); }
+
+inline void answer_time(Variant v, int64_t ns) {
+    uint64_t us = ns > 0 ? (uint64_t)ns / 1000 : 0;
+    int i = AnswerLayout::index(us);
+    if (i >= ANSWER_BUCKETS) i = ANSWER_BUCKETS - 1;
+    Shard *s = local();
+    s->answer_count[v].add();
+    s->answer_sum_us[v].add(us);
+    s->answer_buckets[v][i].add();
+}
+
+}
+
+#endif
@@ -0,0 +1,157 @@
+// outq.h
+// Per-connection output queue. Replies are appended into a short chain of
+// fixed size chunks and leave in one sendmsg() carrying an iovec per
+// chunk, so several frames (a verdict and the next assignment, a
+// calcMessage and its text line) cost one syscall. Partial writes just
+// advance the head. size() is what the engine compares against its
+// backpressure limits.
+
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+class OutputQueue {
+public:
+    static const size_t CHUNK = 2048;
+    static const int MAX_IOV = 64;
+
+    OutputQueue() : head(NULL), tail(NULL), bytes(0) {}
+    ~OutputQueue() { clear(); }
+
+    size_t size() const { return bytes; }
+    bool empty() const { return bytes == 0; }
+
+    void append(const char *p, size_t n) {
+        bytes += n;
+        while (n > 0) {
+            if (!tail || tail->end == CHUNK) {
+                Chunk *c = get_chunk();
+                if (tail) tail->next = c; else head = c;
+                tail = c;
+            }
+            size_t room = CHUNK - tail->end;
+            size_t k = n < room ? n : room;
+            memcpy(tail->data + tail->end, p, k);
+            tail->end += k;
+            p += k;
+            n -= k;
+        }
+    }
+    void append(const char *s) { append(s, strlen(s)); }
+
+    // Describe the queued bytes, oldest first. Returns the iovec count.
+    int fill_iov(struct iovec *iov, int max) const {
+        int n = 0;
+        for (Chunk *c = head; c && n < max; c = c->next) {
+            if (c->end == c->start) continue;
+            iov[n].iov_base = c->data + c->start;
+            iov[n].iov_len = c->end - c->start;
+            n++;
+        }
+        return n;
+    }
+
+    // Drop the first n bytes (they were sent).
+    void consume(size_t n) {
+        bytes -= n;
+        while (n > 0 && head) {
+            size_t k = head->end - head->start;
+            if (n < k) {
+                head->start += n;
+                return;
+            }
+            n -= k;
+            Chunk *c = head;
+            head = c->next;
+            put_chunk(c);
+        }
+        if (!head) tail = NULL;
+        if (head && head->start == head->end && head == tail) head->start = head->end = 0;
+    }
+
+    // One sendmsg() of everything queued. Returns bytes sent or -1 with
+    // errno set (EAGAIN when the socket is full).
+    ssize_t flush(int fd) {
+        struct iovec iov[MAX_IOV];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = fill_iov(iov, MAX_IOV);
+        ssize_t w;
+        do {
+            w = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while (w < 0 && errno == EINTR);
+        if (w > 0) consume((size_t)w);
+        return w;
+    }
+
+    void clear() {
+        while (head) {
+            Chunk *c = head;
+            head = c->next;
+            put_chunk(c);
+        }
+        tail = NULL;
+        bytes = 0;
+    }
+
+private:
+    OutputQueue(const OutputQueue&);
+    OutputQueue& operator=(const OutputQueue&);
+
+    struct Chunk {
+        Chunk *next;
+        uint32_t start, end;
+        char data[CHUNK];
+    };
+
+    // Chunks are recycled through a small per-thread free list, so a
+    // steady stream of sessions does not touch malloc.
+    static const int FREE_MAX = 256;
+    struct FreeList {
+        Chunk *top;
+        int count;
+        ~FreeList() {
+            while (top) { Chunk *c = top; top = c->next; free(c); }
+        }
+    };
+    static FreeList &free_list() {
+        static thread_local FreeList fl = { NULL, 0 };
+        return fl;
+    }
+    static Chunk *get_chunk() {
+        FreeList &fl = free_list();
+        Chunk *c = fl.top;
+        if (c) {
+            fl.top = c->next;
+            fl.count--;
+        } else {
+            c = (Chunk*)malloc(sizeof(Chunk));
+            if (!c) abort();
+        }
+        c->next = NULL;
+        c->start = c->end = 0;
+        return c;
+    }
+    static void put_chunk(Chunk *c) {
+        FreeList &fl = free_list();
+        if (fl.count >= FREE_MAX) {
+            free(c);
+            return;
+        }
+        c->next = fl.top;
+        fl.top = c;
+        fl.count++;
+    }
+
+    Chunk *head, *tail;
+    size_t bytes;
+};
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
 #include <stdint.h>
 
 /* 
@@ -56,3 +59,5 @@ other numbers are reserved
    2 = NOT OK  // Reject 
 
 */
+
+#endif
@@ -0,0 +1,86 @@
+// reactor.cpp
+// epoll wrapper, see reactor.h
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "reactor.h"
+
+Reactor::Reactor() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) perror("epoll_create1");
+}
+
+Reactor::~Reactor() {
+    if (epfd >= 0) close(epfd);
+}
+
+int Reactor::add(int fd, uint32_t ev, EventHandler *h) {
+    struct epoll_event e{};
+    e.events = ev;
+    e.data.ptr = h;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
+}
+
+int Reactor::modify(int fd, uint32_t ev, EventHandler *h) {
+    struct epoll_event e{};
+    e.events = ev;
+    e.data.ptr = h;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e);
+}
+
+int Reactor::remove(int fd) {
+    return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int Reactor::wait(int timeout_ms) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        return -1;
+    }
+    return n;
+}
+
+void Reactor::dispatch(int n) {
+    for (int i = 0; i < n; ++i) {
+        EventHandler *h = (EventHandler*)events[i].data.ptr;
+        h->on_event(events[i].events);
+    }
+}
+
+int Reactor::run_once(int timeout_ms) {
+    int n = wait(timeout_ms);
+    if (n > 0) dispatch(n);
+    return n;
+}
+
+TimerFd::TimerFd() : fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)), fired(false), armed(-1) {}
+
+TimerFd::~TimerFd() {
+    if (fd >= 0) close(fd);
+}
+
+void TimerFd::arm(int64_t at_ms, int64_t interval_ms) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (at_ms >= 0) {
+        // A zero it_value would disarm; anything in the past fires at once.
+        if (at_ms == 0) at_ms = 1;
+        its.it_value.tv_sec = at_ms / 1000;
+        its.it_value.tv_nsec = (at_ms % 1000) * 1000000;
+        its.it_interval.tv_sec = interval_ms / 1000;
+        its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    }
+    if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) perror("timerfd_settime");
+    armed = at_ms;
+}
+
+void TimerFd::on_event(uint32_t) {
+    uint64_t ticks;
+    if (read(fd, &ticks, sizeof(ticks)) == (ssize_t)sizeof(ticks)) fired = true;
+}
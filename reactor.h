@@ -0,0 +1,69 @@
+// reactor.h
+// Minimal epoll event loop shared by the servers. One Reactor per thread;
+// every registered fd carries an EventHandler that gets the ready mask.
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+class EventHandler {
+public:
+    virtual ~EventHandler() {}
+    // Called with the epoll event mask (EPOLLIN, EPOLLOUT, EPOLLERR, ...).
+    virtual void on_event(uint32_t events) = 0;
+};
+
+class Reactor {
+public:
+    Reactor();
+    ~Reactor();
+
+    bool ok() const { return epfd >= 0; }
+    int fd() const { return epfd; }
+
+    int add(int fd, uint32_t events, EventHandler *h);
+    int modify(int fd, uint32_t events, EventHandler *h);
+    int remove(int fd);
+
+    // Wait at most timeout_ms (-1 = forever) and dispatch ready handlers.
+    // Returns the number of events dispatched, or -1 on error.
+    int run_once(int timeout_ms);
+
+    // The two halves of run_once(), for loops that need to do something
+    // (e.g. refresh their clock) between waking up and dispatching.
+    int wait(int timeout_ms);
+    void dispatch(int n);
+
+private:
+    Reactor(const Reactor&);
+    Reactor& operator=(const Reactor&);
+
+    static const int MAX_EVENTS = 256;
+    int epfd;
+    struct epoll_event events[MAX_EVENTS];
+};
+
+// timerfd on CLOCK_MONOTONIC; on_event only notes that it fired, the loop
+// does the work once dispatch is over.
+class TimerFd : public EventHandler {
+public:
+    TimerFd();
+    ~TimerFd();
+
+    // Fire at absolute monotonic time at_ms (-1 disarms), then every
+    // interval_ms if that is non-zero.
+    void arm(int64_t at_ms, int64_t interval_ms = 0);
+    void on_event(uint32_t events);
+
+    int fd;
+    bool fired;
+    int64_t armed;
+
+private:
+    TimerFd(const TimerFd&);
+    TimerFd& operator=(const TimerFd&);
+};
+
+#endif
@@ -0,0 +1,121 @@
+// sockets.cpp
+// Address parsing and listening sockets, see sockets.h
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sockets.h"
+
+bool parse_hostport(const char *input, char *host, size_t hostcap, char *port, size_t portcap) {
+    const char *sep = strchr(input, ':');
+    if (!sep) {
+        fprintf(stderr, "Error: input must be host:port\n");
+        return false;
+    }
+    size_t hostlen = sep - input;
+    if (hostlen >= hostcap) {
+        fprintf(stderr, "hostname too long\n");
+        return false;
+    }
+    memcpy(host, input, hostlen);
+    host[hostlen] = '\0';
+
+    // Port after the colon, digits only
+    const char *port_start = sep + 1;
+    const char *port_end = port_start;
+    while (*port_end && isdigit((unsigned char)*port_end)) port_end++;
+    size_t portlen = port_end - port_start;
+    if (portlen == 0 || portlen >= portcap) {
+        fprintf(stderr, "Invalid port\n");
+        return false;
+    }
+    memcpy(port, port_start, portlen);
+    port[portlen] = '\0';
+    return true;
+}
+
+int setup_listener(const char *host, const char *port, int backlog, bool reuseport) {
+    struct addrinfo hints{}, *res, *rp;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    
+    // Handle special test hostnames
+    const char *actual_host = host;
+    if (strcmp(host, "ip4-localhost") == 0) {
+        actual_host = "127.0.0.1";
+        hints.ai_family = AF_INET;  // Force IPv4
+    } else if (strcmp(host, "ip6-localhost") == 0) {
+        actual_host = "::1";
+        hints.ai_family = AF_INET6; // Force IPv6
+    }
+    
+    if (getaddrinfo(actual_host, port, &hints, &res) != 0) return -1;
+    int listenfd = -1;
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        listenfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (listenfd == -1) continue;
+        int opt = 1;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("setsockopt(SO_REUSEPORT)");
+        }
+        if (bind(listenfd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            if (listen(listenfd, backlog) == 0) break;
+        }
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(res);
+    return listenfd;
+}
+
+int setup_udp_socket(const char *host_in, const char *port, bool reuseport) {
+    const char *host = host_in;
+    bool prefer_ipv6 = false;
+    if (strcmp(host_in, "ip4-localhost") == 0) host = "127.0.0.1";
+    else if (strcmp(host_in, "ip6-localhost") == 0) { host = "::1"; prefer_ipv6 = true; }
+
+    struct addrinfo hints{}, *res = NULL, *rp;
+    hints.ai_family = prefer_ipv6 ? AF_INET6 : AF_INET; // only one family
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = 0;
+
+    int s = getaddrinfo(host, port, &hints, &res);
+    if (s != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        if (rp->ai_family != hints.ai_family) continue; // only bind to requested family
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd == -1) continue;
+        int reuse = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+            perror("setsockopt(SO_REUSEADDR) failed");
+        }
+        if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+            perror("setsockopt(SO_REUSEPORT) failed");
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        int buf = 4 * 1024 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+        if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            freeaddrinfo(res);
+            return fd; // success
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return -1;
+}
@@ -0,0 +1,23 @@
+// sockets.h
+// Address parsing and listening sockets, shared by the server binaries.
+// The test host names "ip4-localhost" and "ip6-localhost" stand for the
+// loopback address of that family.
+
+#ifndef SOCKETS_H
+#define SOCKETS_H
+
+#include <stddef.h>
+
+// Split "host:port" (at the first ':'; the port is the digits after it)
+// into host and port. Prints what is wrong and returns false on error.
+bool parse_hostport(const char *in, char *host, size_t hostcap, char *port, size_t portcap);
+
+// A listening TCP socket on host:port, -1 on error. reuseport sets
+// SO_REUSEPORT, for one listener per worker.
+int setup_listener(const char *host, const char *port, int backlog, bool reuseport);
+
+// A bound UDP socket on host:port (IPv4 unless ip6-localhost), with 4 MB
+// socket buffers, -1 on error.
+int setup_udp_socket(const char *host, const char *port, bool reuseport);
+
+#endif
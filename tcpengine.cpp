@@ -0,0 +1,237 @@
+// tcpengine.cpp
+// epoll driven TCP engine, see tcpengine.h
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tcpengine.h"
+#include "metrics.h"
+#include "log.h"
+
+int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int set_nonblocking(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl < 0) return -1;
+    return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+TcpConn::TcpConn(TcpWorker *w, int fd)
+    : worker(w), fd(fd), paused(false), interest(0) {}
+
+TcpConn::~TcpConn() {}
+
+void TcpConn::start() {
+    worker->active++;
+    metrics::tcp_opened();
+    session.start(out);
+    // The greeting almost always fits in the socket buffer, try it now.
+    if (!do_write()) return;
+    interest = EPOLLIN | (out.empty() ? 0 : EPOLLOUT);
+    if (worker->reactor.add(fd, interest, this) < 0) {
+        LOG_WARN_ERRNO("epoll_ctl(connection)");
+        destroy();
+        return;
+    }
+    worker->touch(this);
+}
+
+void TcpConn::on_event(uint32_t events) {
+    if ((events & (EPOLLERR | EPOLLHUP)) || ((events & EPOLLIN) && !paused)) {
+        if (!do_read()) return;
+    }
+    if (!out.empty()) {
+        if (!do_write()) return;
+    }
+    update_interest();
+}
+
+// Returns false if the connection was destroyed.
+bool TcpConn::do_read() {
+    for (;;) {
+        ssize_t r = in.fill(fd);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            destroy();
+            return false;
+        }
+        if (r == 0) {
+            // Peer went away before the session finished
+            if (!session.done() && !session.streaming()) {
+                fail_timeout();
+                return false;
+            }
+            if (session.streaming()) metrics::session_completed(session.variant());
+            LOG_TRACE(session.trace_id(), "tcp session {}: closed by client", session.trace_id());
+            if (do_write()) destroy();
+            return false;
+        }
+        worker->touch(this);
+        if (session.done()) {
+            in.clear(); // discard anything after the answer
+            continue;
+        }
+        session.consume(in, out, TCP_OUT_HIGH_WATER);
+        if (session.done()) in.release();
+        if (out.size() >= TCP_OUT_HIGH_WATER) {
+            // The client sends faster than it reads its replies; leave
+            // the rest in the buffer and the socket until the queue drains.
+            paused = true;
+            return true;
+        }
+        // A short read means the socket is drained; epoll is level
+        // triggered, so skipping the EAGAIN read loses nothing.
+        if ((size_t)r < InputBuffer::CHUNK) return true;
+    }
+}
+
+// Returns false if the connection was destroyed.
+bool TcpConn::do_write() {
+    while (!out.empty()) {
+        ssize_t w = out.flush(fd);
+        if (w < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            destroy();
+            return false;
+        }
+        worker->touch(this);
+    }
+    if (paused && out.size() < TCP_OUT_LOW_WATER) {
+        // Serve the requests that were held back before reading more.
+        session.consume(in, out, TCP_OUT_HIGH_WATER);
+        paused = out.size() >= TCP_OUT_HIGH_WATER;
+        if (!out.empty()) return do_write();
+    }
+    if (out.empty() && session.done()) {
+        destroy();
+        return false;
+    }
+    return true;
+}
+
+void TcpConn::update_interest() {
+    if (fd < 0) return;
+    uint32_t want = (paused ? 0 : EPOLLIN) | (out.empty() ? 0 : EPOLLOUT);
+    if (want != interest) {
+        interest = want;
+        worker->reactor.modify(fd, interest, this);
+    }
+}
+
+void TcpConn::fail_timeout() {
+    // Best effort, the socket may well be full or gone already.
+    metrics::verdict(session.variant(), metrics::ERROR_TO);
+    LOG_TRACE(session.trace_id(), "tcp session {}: timed out", session.trace_id());
+    const char *err = "ERROR TO\n";
+    ssize_t ignored = write(fd, err, strlen(err));
+    (void)ignored;
+    destroy();
+}
+
+void TcpConn::timeout() {
+    fail_timeout();
+}
+
+void TcpConn::destroy() {
+    worker->timers.cancel(this);
+    worker->active--;
+    if (worker->admission) worker->admission->tcp_closed();
+    metrics::tcp_closed();
+    close(fd);
+    fd = -1;
+    delete this;
+}
+
+void reject_busy(int fd) {
+    // A fresh socket has room for this; if not, the close says enough.
+    static const char busy[] = "ERROR BUSY\n";
+    ssize_t ignored = send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)ignored;
+    close(fd);
+}
+
+void TcpAcceptor::on_event(uint32_t) {
+    for (;;) {
+        struct sockaddr_storage cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        int connfd = accept4(worker->listenfd, (struct sockaddr*)&cliaddr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            LOG_WARN_ERRNO("accept");
+            return;
+        }
+        if (worker->admission && !worker->admission->admit_tcp(cliaddr, worker->now)) {
+            reject_busy(connfd);
+            continue;
+        }
+        TcpConn *c = new TcpConn(worker, connfd);
+        c->start();
+        if (worker->max_sessions && ++worker->served >= worker->max_sessions) {
+            worker->stop_accepting();
+            return;
+        }
+    }
+}
+
+TcpWorker::TcpWorker()
+    : acceptor(this), timers(monotonic_ms()), now(monotonic_ms()), active(0),
+      exclusive(false), max_sessions(0), served(0), listenfd(-1), admission(NULL) {}
+
+void TcpWorker::stop_accepting() {
+    if (listenfd < 0) return;
+    reactor.remove(listenfd);
+    listenfd = -1;
+}
+
+static void conn_timeout(TimerNode *t) {
+    static_cast<TcpConn*>(t)->timeout();
+}
+
+int TcpWorker::start(int lfd) {
+    if (!reactor.ok()) return -1;
+    set_nonblocking(lfd);
+    if (reactor.add(lfd, EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0), &acceptor) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    listenfd = lfd;
+    if (admission) admission->watch_listener(lfd);
+    return 0;
+}
+
+int TcpWorker::step() {
+    int timeout = timers.next_timeout(now);
+    if (admission) timeout = admission->wait_timeout(timeout);
+    int n = reactor.wait(timeout);
+    if (n < 0) {
+        LOG_ERROR_ERRNO("epoll_wait");
+        return -1;
+    }
+    now = monotonic_ms();
+    reactor.dispatch(n);
+    timers.advance(now, conn_timeout);
+    if (admission) {
+        int64_t done = monotonic_ms();
+        admission->round(done - now, done);
+    }
+    return 0;
+}
+
+int TcpWorker::run(int lfd) {
+    if (start(lfd) < 0) return -1;
+    while (listenfd >= 0 || active > 0) {
+        if (step() < 0) return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+// tcpengine.h
+// Non-blocking epoll engine for the TCP server. One TcpWorker owns a
+// Reactor, the listening socket's acceptor and every connection accepted
+// on it; all sessions are served from that single thread, no process or
+// thread is created per connection. run() is the whole loop; start() and
+// step() are its parts, for a loop that serves other sockets on the same
+// reactor (calcserver).
+
+#ifndef TCPENGINE_H
+#define TCPENGINE_H
+
+#include <stdint.h>
+#include <string>
+
+#include "admission.h"
+#include "inbuf.h"
+#include "outq.h"
+#include "reactor.h"
+#include "tcpsession.h"
+#include "timerwheel.h"
+
+// Per-operation timeout, on expiry the client gets "ERROR TO\n".
+static const int TCP_OP_TIMEOUT_MS = 5000;
+
+// Backpressure: stop reading from a client once this much output is
+// queued for it, resume when it has drained below the low mark.
+static const size_t TCP_OUT_HIGH_WATER = 64 * 1024;
+static const size_t TCP_OUT_LOW_WATER = 16 * 1024;
+
+struct TcpWorker;
+
+class TcpConn : public EventHandler, public TimerNode {
+public:
+    TcpConn(TcpWorker *w, int fd);
+    void start();
+    void on_event(uint32_t events);
+    void timeout();
+
+private:
+    ~TcpConn();
+    bool do_read();
+    bool do_write();
+    void update_interest();
+    void fail_timeout();
+    void destroy();
+
+    TcpWorker *worker;
+    int fd;
+    TcpSession session;
+    InputBuffer in;
+    OutputQueue out;
+    bool paused; // reading stopped by backpressure
+    uint32_t interest;
+};
+
+class TcpAcceptor : public EventHandler {
+public:
+    explicit TcpAcceptor(TcpWorker *w) : worker(w) {}
+    void on_event(uint32_t events);
+
+private:
+    TcpWorker *worker;
+};
+
+struct TcpWorker {
+    TcpWorker();
+
+    // Register listenfd (made non-blocking) and serve until max_sessions
+    // have been accepted and finished (forever if max_sessions is 0).
+    int run(int listenfd);
+    void stop_accepting();
+
+    // Register listenfd with the reactor; -1 on error.
+    int start(int listenfd);
+    // One round: wait for events (at most until the next timeout), handle
+    // them, fire due timeouts. -1 if epoll_wait failed.
+    int step();
+
+    // Restart c's per-operation timeout.
+    void touch(TcpConn *c) { timers.arm(c, now + TCP_OP_TIMEOUT_MS); }
+
+    Reactor reactor;
+    TcpAcceptor acceptor;
+    TimerWheel timers;
+    int64_t now; // monotonic ms, refreshed once per loop iteration
+    long active;
+
+    // Set before run(). exclusive registers the listener with
+    // EPOLLEXCLUSIVE, for listeners shared by several worker processes.
+    bool exclusive;
+    long max_sessions;
+    long served;
+    int listenfd;
+    // New connections go through it when set (admission.h).
+    Admission *admission;
+};
+
+int64_t monotonic_ms();
+int set_nonblocking(int fd);
+// Turn away a connection admission control refused, and close it.
+void reject_busy(int fd);
+
+#endif
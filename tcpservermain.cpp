@@ -1,17 +1,42 @@
 // tcpServer.cpp
-// Usage: tcpServer host:port
-// Fork per connection. Supports TEXT TCP 1.1 and BINARY TCP 1.1.
-// Per-operation timeout 5s -> on timeout send "ERROR TO\n" and exit child.
+// Usage: tcpServer [-e epoll|uring] [-t threads | -P procs [-R sessions]] [-b backlog] [-B] [-U path] [-T n]
+//                  [-m sessions] [-H rate[/burst]] [-L ms] host:port
+// Single process epoll engine (tcpengine.cpp), one state machine per
+// connection (tcpsession.cpp). Supports TEXT TCP 1.1 and BINARY TCP 1.1.
+// Per-operation timeout 5s -> on timeout send "ERROR TO\n" and close.
+//
+// -e E  event engine: epoll (default) or uring (tcpuring.cpp); uring falls
+//       back to epoll when the kernel cannot run it, and is not used
+//       together with -R.
+// -t N  run N worker threads, each with its own SO_REUSEPORT listener and
+//       event loop (0 = one per online CPU). Default is a single worker.
+// -P N  pre-fork N long-lived worker processes (0 = one per online CPU)
+//       that share one listener; the master only supervises them.
+// -R N  with -P, a worker exits after accepting N sessions and is
+//       replaced (default 0, never).
+// -b N  listen() backlog, default SOMAXCONN.
+// -B    attach a CBPF reuseport program that hands each connection to the
+//       worker pinned to the CPU that received it.
+// -U P  serve metrics (metrics.h) on the Unix socket P.
+// -T N  trace one session in N to the log (log.h).
+// Admission control (admission.h), all off by default; a refused client
+// gets "ERROR BUSY":
+// -m N  at most N sessions open at once, over all workers.
+// -H R  at most R new sessions per second from one source address per
+//       worker, in bursts of R (or B with R/B).
+// -L N  shed new sessions while event loop rounds take over N ms or the
+//       accept queue is more than half full.
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 #include <sys/ioctl.h> 
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <fcntl.h>
-#include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
@@ -24,381 +49,297 @@
 #include <vector>
 #include <string>
 #include <ctype.h>
+#include <sched.h>
+#include <pthread.h>
+#include <linux/filter.h>
+#include <thread>
 
 
 #include "protocol.h"
+#include "tcpengine.h"
+#include "tcpuring.h"
+#include "metrics.h"
+#include "log.h"
+#include "sockets.h"
 extern "C" {
 #include "calcLib.h"
 }
 
 using namespace std;
 
-static int conn_fd_for_alarm = -1;
-
-// Function declarations
-void handle_tcp_client(int fd);
-void handle_text_protocol(int fd);
-void handle_binary_protocol(int fd);
-
-void alarm_handler(int) {
-    if (conn_fd_for_alarm != -1) {
-        const char *msg = "ERROR TO\n";
-        write(conn_fd_for_alarm, msg, strlen(msg));
-        close(conn_fd_for_alarm);
-    }
-    _exit(1);
+// Steer each new connection to reuseport group member (cpu % n). Members
+// are numbered in bind order, and worker i is pinned to CPU i.
+int attach_cpu_steering(int listenfd, unsigned n) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    return setsockopt(listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
 }
 
-ssize_t full_read(int fd, void *buf, size_t count) {
-    size_t done = 0;
-    char *p = (char*)buf;
-    while (done < count) {
-        ssize_t r = read(fd, p + done, count - done);
-        if (r == 0) return done;
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        done += r;
-    }
-    return (ssize_t)done;
+static void pin_to_cpu(std::thread &t, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rv = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+    if (rv != 0) fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(rv));
 }
 
-ssize_t recv_line(int fd, std::string &out) {
-    out.clear();
-    char c;
-    while (1) {
-        ssize_t r = read(fd, &c, 1);
-        if (r == 0) return 0;
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        out.push_back(c);
-        if (c == '\n') break;
+static bool use_uring = false;
+static AdmissionConfig admission_cfg;  // per worker
+static SessionCap *session_cap = NULL;  // -m, shared by all workers
+
+// Serve listenfd on the calling thread with the selected engine, as
+// worker slot (its session_cap slot).
+static int serve(int listenfd, long max_sessions, bool exclusive, int slot) {
+    Admission admission(admission_cfg);
+    Admission *adm = admission_cfg.enabled() ? &admission : NULL;
+    if (session_cap) admission.share_cap(session_cap, slot);
+    if (use_uring) {
+        TcpUringWorker *uworker = new TcpUringWorker();
+        uworker->admission = adm;
+        int rv = uworker->run(listenfd);
+        delete uworker;
+        if (rv >= 0) return rv;
+        fprintf(stderr, "io_uring engine failed to start, using epoll\n");
     }
-    return out.size();
-}
-
-int setup_listener(const char *host, const char *port) {
-    struct addrinfo hints{}, *res, *rp;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-    
-    // Handle special test hostnames
-    const char *actual_host = host;
-    if (strcmp(host, "ip4-localhost") == 0) {
-        actual_host = "127.0.0.1";
-        hints.ai_family = AF_INET;  // Force IPv4
-    } else if (strcmp(host, "ip6-localhost") == 0) {
-        actual_host = "::1";
-        hints.ai_family = AF_INET6; // Force IPv6
-    }
-    
-    if (getaddrinfo(actual_host, port, &hints, &res) != 0) return -1;
-    int listenfd = -1;
-    for (rp = res; rp != NULL; rp = rp->ai_next) {
-        listenfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (listenfd == -1) continue;
-        int opt = 1;
-        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        if (bind(listenfd, rp->ai_addr, rp->ai_addrlen) == 0) {
-            if (listen(listenfd, 16) == 0) break;
-        }
-        close(listenfd);
-        listenfd = -1;
-    }
-    freeaddrinfo(res);
-    return listenfd;
+    TcpWorker worker;
+    worker.admission = adm;
+    worker.exclusive = exclusive;
+    worker.max_sessions = max_sessions;
+    return worker.run(listenfd);
 }
 
+static pid_t spawn_worker(int listenfd, long max_sessions, const sigset_t *oldmask, int sfd, int slot) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
 
+    close(sfd);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    sigprocmask(SIG_SETMASK, oldmask, NULL);
+    // Each worker needs its own random sequence.
+    initCalcLib();
+    // The slot's previous worker is dead, and its sessions with it.
+    if (session_cap) session_cap->reset(slot);
 
-void handle_tcp_client(int fd) {
-    conn_fd_for_alarm = fd;
-    signal(SIGALRM, alarm_handler);
-
-    // Send list of supported protocols
-    const char *protocols = "TEXT TCP 1.1\nBINARY TCP 1.1\n\n";
-    alarm(5);
-    ssize_t sent = write(fd, protocols, strlen(protocols));
-    alarm(0);
+    int rv = serve(listenfd, max_sessions, true, slot);
+    logging::flush();
+    _exit(rv == 0 ? 0 : 1);
+}
 
-    if (sent != (ssize_t)strlen(protocols)) {
-        close(fd);
-        return;
+// Master side of -P: keep nprocs workers alive, reaping them through a
+// signalfd so no signal handler ever runs. A slot whose worker died or
+// could not be forked is refilled from the loop; when forks fail or a
+// worker keeps dying the refill waits, in poll(), not in a sleep that
+// would hold up SIGTERM.
+static const int64_t RESPAWN_RETRY_MS = 1000;
+
+static int run_prefork(int listenfd, int nprocs, long max_sessions) {
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0) {
+        perror("sigprocmask");
+        return 1;
     }
-
-    // Wait for client protocol selection
-    std::string client_response;
-    alarm(5);
-    ssize_t r = recv_line(fd, client_response);
-    alarm(0);
-    if (r <= 0) {
-        const char *err = "ERROR TO\n";
-        write(fd, err, strlen(err));
-        close(fd);
-        return;
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd < 0) {
+        perror("signalfd");
+        return 1;
     }
 
-    // Trim whitespace
-    while (!client_response.empty() && (client_response.back() == '\n' || client_response.back() == '\r'))
-        client_response.pop_back();
-
-    // Check if client selected binary or text protocol
-    std::string lower = client_response;
-    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
-
-    if (lower.find("binary tcp 1.1 ok") != std::string::npos) {
-        handle_binary_protocol(fd);
-    } else if (lower.find("text tcp 1.1 ok") != std::string::npos) {
-        handle_text_protocol(fd);
-    } else {
-        // Unsupported protocol
-        const char *err = "ERROR: MISSMATCH PROTOCOL\n";
-        write(fd, err, strlen(err));
-        close(fd);
+    std::vector<pid_t> workers(nprocs, -1);
+    int64_t retry_at = 0;  // monotonic ms from which empty slots are refilled
+    for (int i = 0; i < nprocs; ++i) {
+        workers[i] = spawn_worker(listenfd, max_sessions, &oldmask, sfd, i);
+        if (workers[i] < 0) {
+            LOG_ERROR_ERRNO("fork");
+            retry_at = monotonic_ms() + RESPAWN_RETRY_MS;
+            break;
+        }
     }
-}
-
-void handle_text_protocol(int fd) {
-    // Generate and send assignment
-    int code = (rand() % 4) + 1;
-    int a = randomInt();
-    int b = (code == 4) ? ((randomInt() == 0) ? 1 : randomInt()) : randomInt();
-    if (code == 4 && b == 0) b = 1;
-
-    const char *opstr = "add";
-    if (code == 1) opstr = "add";
-    else if (code == 2) opstr = "sub";
-    else if (code == 3) opstr = "mul";
-    else opstr = "div";
 
-    char task[128];
-    int task_len = snprintf(task, sizeof(task), "ASSIGNMENT: %s %d %d\n", opstr, a, b);
+    int64_t window = 0;
+    int respawns = 0;
+    for (;;) {
+        int64_t now = monotonic_ms();
+        for (int i = 0; i < nprocs && now >= retry_at; ++i) {
+            if (workers[i] >= 0) continue;
+            // A worker that keeps dying must not turn into a fork loop.
+            if (now / 1000 != window) { window = now / 1000; respawns = 0; }
+            if (++respawns > 2 * nprocs) {
+                retry_at = (window + 1) * 1000;
+                break;
+            }
+            workers[i] = spawn_worker(listenfd, max_sessions, &oldmask, sfd, i);
+            if (workers[i] < 0) {
+                LOG_ERROR_ERRNO("fork");
+                retry_at = now + RESPAWN_RETRY_MS;
+                break;
+            }
+        }
 
-    alarm(5);
-    ssize_t sent = write(fd, task, task_len);
-    alarm(0);
-    if (sent != task_len) {
-        close(fd);
-        return;
+        bool vacant = std::find(workers.begin(), workers.end(), -1) != workers.end();
+        struct pollfd p = { sfd, POLLIN, 0 };
+        int n = poll(&p, 1, vacant ? (int)std::max<int64_t>(retry_at - now, 0) : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (n == 0) continue;
+        struct signalfd_siginfo si;
+        ssize_t r = read(sfd, &si, sizeof(si));
+        if (r != sizeof(si)) {
+            if (r < 0 && errno == EINTR) continue;
+            perror("signalfd read");
+            break;
+        }
+        if (si.ssi_signo != SIGCHLD) break;
+
+        // One SIGCHLD may stand for several exits.
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < nprocs; ++i) {
+                if (workers[i] != pid) continue;
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    LOG_WARN("worker {} died (status {}), respawning", pid, status);
+                }
+                workers[i] = -1;
+            }
+        }
     }
 
-    // Wait for answer
-    std::string line;
-    alarm(5);
-    ssize_t r = recv_line(fd, line);
-    alarm(0);
-    if (r <= 0) {
-        const char *err = "ERROR TO\n";
-        write(fd, err, strlen(err));
-        close(fd);
-        return;
+    for (int i = 0; i < nprocs; ++i) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
     }
+    while (waitpid(-1, NULL, 0) > 0) {}
+    return 0;
+}
 
-    // Trim newline
-    while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
-        line.pop_back();
-
-    // Calculate expected result
-    int expected = 0;
-    if (code == 1) expected = a + b;
-    else if (code == 2) expected = a - b;
-    else if (code == 3) expected = a * b;
-    else if (code == 4) expected = a / b;
-
-    // Parse and validate answer
-    line.erase(std::remove_if(line.begin(), line.end(), ::isspace), line.end());
-
-    bool ok = false;
-    int answer_int = 0;
-    double answer_double = 0.0;
-
-    // Try integer first
-    if (sscanf(line.c_str(), "%d", &answer_int) == 1) {
-        if (answer_int == expected) ok = true;
-    } else if (sscanf(line.c_str(), "%lf", &answer_double) == 1) {
-        if (fabs(answer_double - expected) < 0.0001) ok = true;
+int main(int argc, char *argv[]) {
+    int nthreads = 1;
+    int nprocs = -1;
+    long max_sessions = 0;
+    int backlog = SOMAXCONN;
+    bool steer = false;
+    const char *metrics_path = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "e:t:P:R:b:BU:T:m:H:L:")) != -1) {
+        switch (c) {
+        case 'e':
+            if (strcmp(optarg, "uring") == 0) use_uring = true;
+            else if (strcmp(optarg, "epoll") != 0) optind = argc;
+            break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'P': nprocs = atoi(optarg); break;
+        case 'R': max_sessions = atol(optarg); break;
+        case 'b': backlog = atoi(optarg); break;
+        case 'B': steer = true; break;
+        case 'U': metrics_path = optarg; break;
+        case 'T': logging::trace_every = (unsigned)atoi(optarg); break;
+        case 'm': admission_cfg.max_sessions = atol(optarg); break;
+        case 'H':
+            if (!parse_hello_rate(optarg, admission_cfg)) optind = argc;
+            break;
+        case 'L': admission_cfg.lag_ms = atoi(optarg); break;
+        default:
+            optind = argc;
+            break;
+        }
     }
-
-    if (ok) {
-        char result[64];
-        snprintf(result, sizeof(result), "OK (myresult=%d)\n", answer_int);
-        alarm(5);
-        write(fd, result, strlen(result));
-        alarm(0);
-    } else {
-        alarm(5);
-        write(fd, "ERROR\n", 6);
-        alarm(0);
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-e epoll|uring] [-t threads | -P procs [-R sessions]] [-b backlog] [-B] [-U path] [-T n] [-m sessions] [-H rate[/burst]] [-L ms] host:port\n", argv[0]);
+        exit(EXIT_FAILURE);
     }
-    close(fd);
-}
-
-void handle_binary_protocol(int fd) {
-    // Generate task
-    int code = (rand() % 4) + 1;
-    int i1 = randomInt();
-    int i2;
-    if (code == 4) {
-        do { i2 = randomInt(); } while (i2 == 0);
-    } else {
-        i2 = randomInt();
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    if (nthreads <= 0) nthreads = ncpu;
+    if (nprocs == 0) nprocs = ncpu;
+    if (nprocs > 0 && nthreads > 1) {
+        fprintf(stderr, "-t and -P are mutually exclusive\n");
+        exit(EXIT_FAILURE);
     }
-
-    int32_t expected = 0;
-    if (code == 1) expected = i1 + i2;
-    else if (code == 2) expected = i1 - i2;
-    else if (code == 3) expected = i1 * i2;
-    else if (code == 4) expected = i1 / i2;
-
-    uint32_t task_id = (uint32_t)(rand() ^ time(NULL));
-
-    // For TCP Binary, send calcProtocol message directly (no text assignment line)
-    calcProtocol cp{};
-    cp.type = htons(1);  // server to client
-    cp.major_version = htons(1);
-    cp.minor_version = htons(1);
-    cp.id = htonl(task_id);
-    cp.arith = htonl(code);
-    cp.inValue1 = htonl(i1);
-    cp.inValue2 = htonl(i2);
-    cp.inResult = htonl(0);
-
-    alarm(5);
-    ssize_t sent = write(fd, &cp, sizeof(cp));
-    alarm(0);
-    if (sent != sizeof(cp)) {
-        close(fd);
-        return;
+    if (backlog <= 0) backlog = SOMAXCONN;
+    int nworkers = nprocs > 0 ? nprocs : nthreads;
+    admission_cfg = admission_cfg.per_worker(nworkers);
+    if (admission_cfg.max_sessions > 0) {
+        session_cap = SessionCap::create(admission_cfg.max_sessions, nworkers);
+        if (!session_cap) return 1;
     }
-
-    // Wait for client response
-    calcProtocol response;
-    alarm(5);
-    ssize_t r = full_read(fd, &response, sizeof(response));
-    alarm(0);
-    if (r != sizeof(response)) {
-        const char *err = "ERROR TO\n";
-        write(fd, err, strlen(err));
-        close(fd);
-        return;
+    if (use_uring && max_sessions > 0) {
+        fprintf(stderr, "-R needs the epoll engine, using epoll\n");
+        use_uring = false;
     }
-
-    // Convert to host order
-    uint16_t resp_type = ntohs(response.type);
-    uint32_t resp_id = ntohl(response.id);
-    int32_t resp_result = ntohl(response.inResult);
-
-    // Send response
-    calcMessage msg{};
-    msg.type = htons(2);  // server to client
-    msg.protocol = htons(6);  // TCP
-    msg.major_version = htons(1);
-    msg.minor_version = htons(1);
-
-    if (resp_type == 2 && resp_id == task_id && resp_result == expected) {
-        msg.message = htonl(1);  // OK
-        alarm(5);
-        write(fd, &msg, sizeof(msg));
-        alarm(0);
-
-        // Send human-readable OK line for compatibility
-        char okline[64];
-        snprintf(okline, sizeof(okline), "OK (myresult=%d)\n", resp_result);
-        alarm(5);
-        write(fd, okline, strlen(okline));
-        alarm(0);
-    } else {
-        msg.message = htonl(2);  // NOT OK
-        alarm(5);
-        write(fd, &msg, sizeof(msg));
-        alarm(0);
-
-        char nokline[64];
-        snprintf(nokline, sizeof(nokline), "ERROR\n");
-        alarm(5);
-        write(fd, nokline, strlen(nokline));
-        alarm(0);
+    if (use_uring && !TcpUringWorker::available()) {
+        fprintf(stderr, "io_uring not supported here, using epoll\n");
+        use_uring = false;
     }
-    close(fd);
-}
-
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s host:port\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
     initCalcLib();
-    srand(time(NULL));
 
-    // Parse host:port
-    char *input = argv[1];
-    char *sep = strchr(input, ':');
-    if (!sep) { 
-        fprintf(stderr, "Error: input must be host:port\n"); 
-        return 1; 
-    }
-    char host[256]; 
+    char host[256];
     char port[64];
-    size_t hostlen = sep - input;
-    if (hostlen >= sizeof(host)) { 
-        fprintf(stderr, "hostname too long\n"); 
-        return 1; 
+    if (!parse_hostport(argv[optind], host, sizeof(host), port, sizeof(port))) return 1;
+
+    // One listener per worker; with a single worker this is the plain
+    // listener we always had.
+    bool reuseport = nthreads > 1;
+    std::vector<int> listeners;
+    for (int i = 0; i < nthreads; ++i) {
+        int listenfd = setup_listener(host, port, backlog, reuseport);
+        if (listenfd < 0) { 
+            perror("setup_listener"); 
+            return 1; 
+        }
+        listeners.push_back(listenfd);
     }
-    strncpy(host, input, hostlen); 
-    host[hostlen] = '\0';
-
-    // Parse port after colon, digits only
-    char *port_start = sep + 1;
-    char *port_end = port_start;
-    while (*port_end && isdigit(*port_end)) port_end++;
-    size_t portlen = port_end - port_start;
-    if (portlen == 0 || portlen >= sizeof(port)) {
-        fprintf(stderr, "Invalid port\n");
-        return 1;
+    if (steer && nthreads > ncpu) {
+        fprintf(stderr, "warning: -B with more threads than CPUs leaves %d workers idle\n", nthreads - ncpu);
     }
-    strncpy(port, port_start, portlen);
-    port[portlen] = '\0';
-
-    int listenfd = setup_listener(host, port);
-    if (listenfd < 0) { 
-        perror("setup_listener"); 
-        return 1; 
+    if (steer && reuseport && attach_cpu_steering(listeners[0], nthreads) < 0) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        steer = false;
     }
     fprintf(stderr, "TCP server on %s:%s\n", host, port);
 
+    // Before any worker exists, so all of them record into the shared shards.
+    metrics::init();
+    if (metrics_path && metrics::serve(metrics_path) < 0) return 1;
+
     signal(SIGPIPE, SIG_IGN);
 
-    while (1) {
-        struct sockaddr_storage cliaddr;
-        socklen_t clilen = sizeof(cliaddr);
-        int connfd = accept(listenfd, (struct sockaddr*)&cliaddr, &clilen);
-        if (connfd < 0) {
-            if (errno == EINTR) continue;
-            perror("accept");
-            continue;
-        }
-        
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
-            close(connfd);
-            continue;
-        } else if (pid == 0) {
+    if (nprocs > 0) {
+        int rv = run_prefork(listeners[0], nprocs, max_sessions);
+        close(listeners[0]);
+        return rv;
+    }
+
+    if (nthreads == 1) {
+        serve(listeners[0], 0, false, 0);
+        close(listeners[0]);
+        return 1;
+    }
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthreads; ++i) {
+        int listenfd = listeners[i];
+        threads.emplace_back([listenfd, i]() {
+            serve(listenfd, 0, false, i);
             close(listenfd);
-            
-            // TCP protocol: Server sends list of supported protocols first
-            handle_tcp_client(connfd);
-            _exit(0);
-        } else {
-            close(connfd);
-            while (waitpid(-1, NULL, WNOHANG) > 0) {}
-        }
+        });
+        if (steer) pin_to_cpu(threads.back(), i % ncpu);
     }
-    close(listenfd);
-    return 0;
-}
\ No newline at end of file
+    // Workers only return on a fatal error.
+    for (auto &t : threads) t.join();
+    return 1;
+}
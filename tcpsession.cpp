@@ -0,0 +1,249 @@
+// tcpsession.cpp
+// TCP protocol state machine, see tcpsession.h
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+
+#include "protocol.h"
+#include "tcpsession.h"
+#include "assignpool.h"
+#include "wirecodec.h"
+#include "textproto.h"
+#include "metrics.h"
+#include "log.h"
+extern "C" {
+#include "calcLib.h"
+}
+
+// Assignments come pre-built from the pool (assignpool.h); only the id
+// and minor version of a binary frame are per session.
+static int32_t make_text_assignment(OutputQueue &out) {
+    Assignment a;
+    next_assignment(a);
+    out.append(a.text, a.text_len);
+    return a.expected;
+}
+
+static int32_t make_binary_assignment(OutputQueue &out, uint32_t task_id, uint16_t minor) {
+    Assignment a;
+    next_assignment(a);
+    // For TCP Binary, send calcProtocol message directly (no text assignment line)
+    a.stamp(task_id, minor);
+    out.append((const char*)a.binary, Assignment::BINARY_SIZE);
+    return a.expected;
+}
+
+static void append_text_verdict(OutputQueue &out, bool ok, int answer_int) {
+    if (ok) {
+        char result[textproto::OK_LINE_MAX];
+        out.append(result, textproto::format_ok_line(result, answer_int));
+    } else {
+        out.append("ERROR\n");
+    }
+}
+
+static void append_calc_message(OutputQueue &out, uint32_t message, uint16_t minor) {
+    calcMessage msg;
+    msg.type = 2;  // server to client
+    msg.message = message;
+    msg.protocol = 6;  // TCP
+    msg.major_version = 1;
+    msg.minor_version = minor;
+    char buf[wire::CalcMessage::SIZE];
+    wire::CalcMessage::encode(buf, msg);
+    out.append(buf, sizeof(buf));
+}
+
+TcpSession::TcpSession()
+    : state(ST_SELECT), var(metrics::NONE), expected(0), assigned(0), task_id(0), trace(logging::sample_session()),
+      task_head(0), task_count(0) {}
+
+void TcpSession::select(metrics::Variant v) {
+    var = v;
+    metrics::session_started(v);
+    LOG_TRACE(trace, "tcp session {}: variant {} selected", trace, v);
+}
+
+// Verdict and answer time of one answer; a 1.1 session ends with it.
+void TcpSession::record(bool ok, int64_t since) {
+    int64_t now = metrics::now_ns();
+    metrics::answer_time(var, now - since);
+    LOG_TRACE(trace, "tcp session {}: answer ok={} after {} us", trace, ok, (now - since) / 1000);
+    metrics::verdict(var, ok ? metrics::OK : metrics::NOT_OK);
+    if (!streaming()) metrics::session_completed(var);
+}
+
+void TcpSession::start(OutputQueue &out) {
+    LOG_TRACE(trace, "tcp session {}: opened", trace);
+    // Send list of supported protocols
+    out.append("TEXT TCP 1.1\nBINARY TCP 1.1\nTEXT TCP 1.2\nBINARY TCP 1.2\n\n");
+}
+
+void TcpSession::consume(InputBuffer &in, OutputQueue &out, size_t out_limit) {
+    while (state != ST_DONE && out.size() < out_limit) {
+        if (state == ST_BINARY_ANSWER || state == ST_BINARY_STREAM) {
+            const char *frame;
+            if (!in.take(sizeof(calcProtocol), frame)) break;
+            if (state == ST_BINARY_ANSWER) binary_answer(frame, out);
+            else stream_binary_answer(frame, out);
+            continue;
+        }
+        std::string_view line;
+        if (!in.read_line(line)) break;
+        if (state == ST_SELECT) handle_tcp_client(line, out);
+        else if (state == ST_TEXT_ANSWER) text_answer(line, out);
+        else stream_text_answer(line, out);
+    }
+}
+
+void TcpSession::handle_tcp_client(std::string_view line, OutputQueue &out) {
+    // Check if client selected binary or text protocol
+    int window;
+    switch (textproto::parse_selection(line, window)) {
+    case textproto::SEL_BINARY_11:
+        select(metrics::BINARY_TCP);
+        handle_binary_protocol(out);
+        break;
+    case textproto::SEL_TEXT_11:
+        select(metrics::TEXT_TCP);
+        handle_text_protocol(out);
+        break;
+    case textproto::SEL_BINARY_12:
+        select(metrics::BINARY_TCP_STREAM);
+        start_stream(true, window, out);
+        break;
+    case textproto::SEL_TEXT_12:
+        select(metrics::TEXT_TCP_STREAM);
+        start_stream(false, window, out);
+        break;
+    default:
+        // Unsupported protocol
+        metrics::verdict(metrics::NONE, metrics::ERROR);
+        LOG_TRACE(trace, "tcp session {}: no protocol in selection", trace);
+        out.append("ERROR: MISSMATCH PROTOCOL\n");
+        state = ST_DONE;
+        break;
+    }
+}
+
+void TcpSession::handle_text_protocol(OutputQueue &out) {
+    // Generate and send assignment
+    expected = make_text_assignment(out);
+    assigned = metrics::now_ns();
+    state = ST_TEXT_ANSWER;
+}
+
+void TcpSession::text_answer(std::string_view line, OutputQueue &out) {
+    int answer_int;
+    bool ok = textproto::check_answer(line, expected, answer_int);
+    append_text_verdict(out, ok, answer_int);
+    state = ST_DONE;
+    record(ok, assigned);
+}
+
+void TcpSession::handle_binary_protocol(OutputQueue &out) {
+    // Generate task
+    task_id = (uint32_t)calcRngNext(calcRngThread());
+    expected = make_binary_assignment(out, task_id, 1);
+    assigned = metrics::now_ns();
+    state = ST_BINARY_ANSWER;
+}
+
+void TcpSession::binary_answer(const char *frame, OutputQueue &out) {
+    // Only the fields we check, straight from the frame
+    uint16_t resp_type = wire::CalcProtocol::get<&calcProtocol::type>(frame);
+    uint32_t resp_id = wire::CalcProtocol::get<&calcProtocol::id>(frame);
+    int32_t resp_result = wire::CalcProtocol::get<&calcProtocol::inResult>(frame);
+
+    bool ok = resp_type == 2 && resp_id == task_id && resp_result == expected;
+    if (ok) {
+        append_calc_message(out, 1, 1);  // OK
+
+        // Send human-readable OK line for compatibility
+        char okline[textproto::OK_LINE_MAX];
+        out.append(okline, textproto::format_ok_line(okline, resp_result));
+    } else {
+        append_calc_message(out, 2, 1);  // NOT OK
+        out.append("ERROR\n");
+    }
+    state = ST_DONE;
+    record(ok, assigned);
+}
+
+// window is what the selection line asked for.
+void TcpSession::start_stream(bool binary, int window, OutputQueue &out) {
+    if (window < 1) window = 1;
+    if (window > TCP_MAX_WINDOW) window = TCP_MAX_WINDOW;
+
+    state = binary ? ST_BINARY_STREAM : ST_TEXT_STREAM;
+    task_id = (uint32_t)calcRngNext(calcRngThread());
+    for (int i = 0; i < window; ++i) {
+        if (binary) push_binary_task(out);
+        else push_text_task(out);
+    }
+}
+
+void TcpSession::push_text_task(OutputQueue &out) {
+    Task &t = tasks[(task_head + task_count) % TCP_MAX_WINDOW];
+    t.id = 0;
+    t.expected = make_text_assignment(out);
+    t.assigned = metrics::now_ns();
+    task_count++;
+}
+
+void TcpSession::push_binary_task(OutputQueue &out) {
+    Task &t = tasks[(task_head + task_count) % TCP_MAX_WINDOW];
+    // Consecutive ids from a random start: unique within the window.
+    t.id = task_id++;
+    t.expected = make_binary_assignment(out, t.id, 2);
+    t.assigned = metrics::now_ns();
+    task_count++;
+}
+
+void TcpSession::stream_text_answer(std::string_view line, OutputQueue &out) {
+    if (task_count == 0) return;
+    Task &t = tasks[task_head];
+    task_head = (task_head + 1) % TCP_MAX_WINDOW;
+    task_count--;
+
+    int answer_int;
+    bool ok = textproto::check_answer(line, t.expected, answer_int);
+    append_text_verdict(out, ok, answer_int);
+    record(ok, t.assigned);
+    push_text_task(out);
+}
+
+void TcpSession::stream_binary_answer(const char *frame, OutputQueue &out) {
+    uint16_t resp_type = wire::CalcProtocol::get<&calcProtocol::type>(frame);
+    uint32_t resp_id = wire::CalcProtocol::get<&calcProtocol::id>(frame);
+    int32_t resp_result = wire::CalcProtocol::get<&calcProtocol::inResult>(frame);
+
+    int found = -1;
+    for (int i = 0; i < task_count; ++i) {
+        if (tasks[(task_head + i) % TCP_MAX_WINDOW].id == resp_id) { found = i; break; }
+    }
+    if (found < 0) {
+        // Not an assignment we have in flight, nothing to replace.
+        metrics::verdict(var, metrics::ERROR);
+        LOG_TRACE(trace, "tcp session {}: answer for unknown id {}", trace, resp_id);
+        append_calc_message(out, 2, 2);
+        return;
+    }
+
+    const Task &t = tasks[(task_head + found) % TCP_MAX_WINDOW];
+    bool ok = resp_type == 2 && resp_result == t.expected;
+    record(ok, t.assigned);
+    // Close the gap, keeping the remaining tasks in order.
+    for (int i = found; i > 0; --i) {
+        tasks[(task_head + i) % TCP_MAX_WINDOW] = tasks[(task_head + i - 1) % TCP_MAX_WINDOW];
+    }
+    task_head = (task_head + 1) % TCP_MAX_WINDOW;
+    task_count--;
+
+    append_calc_message(out, ok ? 1 : 2, 2);
+    push_binary_task(out);
+}
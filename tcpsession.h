@@ -0,0 +1,96 @@
+// tcpsession.h
+// Protocol state machine for one TCP client. It does no I/O itself: the
+// engine feeds it received bytes and sends whatever it appends to the
+// output queue. That keeps the session logic the same whichever event
+// engine moves the bytes.
+//
+// TEXT TCP 1.1 / BINARY TCP 1.1: one assignment, one verdict, close.
+//
+// TEXT TCP 1.2 / BINARY TCP 1.2: persistent session. The selection line
+// may carry a window, "TEXT TCP 1.2 OK 8", and the server keeps that many
+// assignments (default 1, at most TCP_MAX_WINDOW) in flight. Every answer
+// gets its verdict followed by a fresh assignment, until the client
+// closes the connection.
+//   text:   answers are matched to assignments in the order they were sent,
+//           verdicts are the same "OK (myresult=N)" / "ERROR" lines as 1.1.
+//   binary: calcProtocol frames with minor_version 2, answered in any
+//           order (matched by id), verdict is a bare calcMessage.
+
+#ifndef TCPSESSION_H
+#define TCPSESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+
+#include "inbuf.h"
+#include "outq.h"
+#include "metrics.h"
+#include "log.h"
+
+static const int TCP_MAX_WINDOW = 64;
+
+class TcpSession {
+public:
+    // greeting -> protocol selection -> assignment -> answer -> verdict
+    enum State { ST_SELECT, ST_TEXT_ANSWER, ST_BINARY_ANSWER,
+                 ST_TEXT_STREAM, ST_BINARY_STREAM, ST_DONE };
+
+    TcpSession();
+
+    // Queue the list of supported protocols.
+    void start(OutputQueue &out);
+
+    // Consume complete messages buffered in `in`, appending replies to
+    // out, until the input runs out or out holds out_limit bytes.
+    // Anything not consumed is left in the buffer.
+    void consume(InputBuffer &in, OutputQueue &out, size_t out_limit = (size_t)-1);
+
+    // True once the verdict (or an error) is queued; the engine closes the
+    // connection after out has drained.
+    bool done() const { return state == ST_DONE; }
+    // Persistent (1.2) sessions end when the client closes; that is not a
+    // timeout and gets no "ERROR TO".
+    bool streaming() const { return state == ST_TEXT_STREAM || state == ST_BINARY_STREAM; }
+    State get_state() const { return state; }
+    // What the client selected, NONE until it has.
+    metrics::Variant variant() const { return var; }
+    // Non-zero when the session is sampled for tracing (log.h).
+    uint32_t trace_id() const { return trace; }
+
+private:
+    struct Task {
+        uint32_t id;
+        int32_t expected;
+        int64_t assigned;  // metrics::now_ns() when queued
+    };
+
+    void select(metrics::Variant v);
+    void record(bool ok, int64_t since);
+
+    void handle_tcp_client(std::string_view line, OutputQueue &out);
+    void handle_text_protocol(OutputQueue &out);
+    void handle_binary_protocol(OutputQueue &out);
+    void text_answer(std::string_view line, OutputQueue &out);
+    void binary_answer(const char *frame, OutputQueue &out);
+
+    void start_stream(bool binary, int window, OutputQueue &out);
+    void push_text_task(OutputQueue &out);
+    void push_binary_task(OutputQueue &out);
+    void stream_text_answer(std::string_view line, OutputQueue &out);
+    void stream_binary_answer(const char *frame, OutputQueue &out);
+
+    State state;
+    metrics::Variant var;
+    int32_t expected;
+    int64_t assigned;
+    uint32_t task_id;
+    uint32_t trace;
+
+    // 1.2 assignments in flight, oldest first (a small ring).
+    Task tasks[TCP_MAX_WINDOW];
+    int task_head, task_count;
+};
+
+#endif
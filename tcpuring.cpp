@@ -0,0 +1,418 @@
+// tcpuring.cpp
+// io_uring TCP engine, see tcpuring.h
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tcpuring.h"
+#include "tcpengine.h"
+#include "metrics.h"
+#include "log.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Uring::Uring()
+    : fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sq_ring_sz(0), cq_ring_sz(0),
+      sqes((struct io_uring_sqe*)MAP_FAILED), sqes_sz(0), sq_entries(0), to_submit(0) {}
+
+Uring::~Uring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_sz);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_sz);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_sz);
+    if (fd >= 0) close(fd);
+}
+
+int Uring::setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = io_uring_setup(entries, &p);
+    if (fd < 0) return -1;
+
+    sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        if (cq_ring_sz > sq_ring_sz) sq_ring_sz = cq_ring_sz;
+        cq_ring_sz = sq_ring_sz;
+    }
+    sq_ring = mmap(NULL, sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) return -1;
+    if (single) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(NULL, cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) return -1;
+    }
+    sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)mmap(NULL, sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return -1;
+
+    char *sq = (char*)sq_ring;
+    char *cq = (char*)cq_ring;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    sq_entries = p.sq_entries;
+    return 0;
+}
+
+bool Uring::supports_engine_ops() {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, len);
+    if (!probe) return false;
+    bool ok = io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_CLOSE,
+                           IORING_OP_LINK_TIMEOUT, IORING_OP_PROVIDE_BUFFERS, IORING_OP_TIMEOUT };
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); ++i) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) ok = false;
+    }
+    free(probe);
+    return ok;
+}
+
+struct io_uring_sqe *Uring::get_sqe() {
+    unsigned tail = *sq_tail;
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        submit(0);
+        tail = *sq_tail;
+    }
+    unsigned idx = tail & *sq_mask;
+    sq_array[idx] = idx;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+    return sqe;
+}
+
+int Uring::submit(unsigned wait_nr) {
+    for (;;) {
+        int r = io_uring_enter(fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        to_submit -= (unsigned)r <= to_submit ? (unsigned)r : to_submit;
+        return r;
+    }
+}
+
+struct io_uring_cqe *Uring::peek_cqe() {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &cqes[head & *cq_mask];
+}
+
+void Uring::cqe_seen() {
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// user_data: connection pointer with the operation in the low bits, or a
+// bare tag for requests that belong to the worker.
+enum { UD_RECV = 1, UD_SEND = 2, UD_CLOSE = 3, UD_ACCEPT = 4, UD_TIMEOUT = 5, UD_PROVIDE = 6, UD_TICK = 7 };
+static const uint64_t UD_TAG_MASK = 7;
+
+static inline uint64_t ud(UringConn *c, int tag) { return (uint64_t)(uintptr_t)c | tag; }
+
+static struct __kernel_timespec op_timeout = { TCP_OP_TIMEOUT_MS / 1000, (TCP_OP_TIMEOUT_MS % 1000) * 1000000LL };
+
+TcpUringWorker::TcpUringWorker() : admission(NULL), listenfd(-1), bufs(NULL), active(0), multishot_accept(true), tick_armed(false) {}
+
+TcpUringWorker::~TcpUringWorker() {
+    free(bufs);
+}
+
+void TcpUringWorker::arm_accept() {
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD_ACCEPT;
+}
+
+void TcpUringWorker::provide_buffers(unsigned bid, unsigned count) {
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int)count;
+    sqe->addr = (uint64_t)(uintptr_t)(bufs + (size_t)bid * BUF_SIZE);
+    sqe->len = BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = UD_PROVIDE;
+}
+
+// Guards the request queued just before it (which must carry IOSQE_IO_LINK).
+struct io_uring_sqe *TcpUringWorker::link_timeout() {
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&op_timeout;
+    sqe->len = 1;
+    sqe->user_data = UD_TIMEOUT;
+    return sqe;
+}
+
+// Wakes an otherwise idle loop after ms, so admission's shed level is
+// brought down without new connections.
+void TcpUringWorker::arm_tick(int ms) {
+    tick_ts.tv_sec = ms / 1000;
+    tick_ts.tv_nsec = (ms % 1000) * 1000000LL;
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&tick_ts;
+    sqe->len = 1;
+    sqe->user_data = UD_TICK;
+    tick_armed = true;
+}
+
+void TcpUringWorker::queue_recv(UringConn *c) {
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = ud(c, UD_RECV);
+    c->inflight++;
+    link_timeout();
+}
+
+// A sendmsg over everything queued, linked to whatever is queued next.
+void TcpUringWorker::prep_send(UringConn *c) {
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = c->out.fill_iov(c->iov, sizeof(c->iov) / sizeof(c->iov[0]));
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = ud(c, UD_SEND);
+    c->inflight++;
+}
+
+void TcpUringWorker::queue_send(UringConn *c) {
+    prep_send(c);
+    link_timeout();
+}
+
+// Last reply of a session: the close runs as soon as the send completes.
+// The send is guarded like any other, a peer that stops reading must not
+// keep the connection: the chain goes on past the timeout to the close,
+// which is then cancelled and done by hand.
+void TcpUringWorker::queue_send_close(UringConn *c) {
+    c->closing = true;
+    if (!c->out.empty()) {
+        prep_send(c);
+        link_timeout()->flags = IOSQE_IO_LINK;
+    }
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = c->fd;
+    sqe->user_data = ud(c, UD_CLOSE);
+    c->inflight++;
+}
+
+void TcpUringWorker::fail_timeout(UringConn *c) {
+    metrics::verdict(c->session.variant(), metrics::ERROR_TO);
+    LOG_TRACE(c->session.trace_id(), "tcp session {}: timed out", c->session.trace_id());
+    c->out.clear();
+    c->out.append("ERROR TO\n");
+    queue_send_close(c);
+}
+
+void TcpUringWorker::release(UringConn *c) {
+    if (!c->closing || c->inflight > 0) return;
+    active--;
+    if (admission) admission->tcp_closed();
+    metrics::tcp_closed();
+    delete c;
+}
+
+void TcpUringWorker::on_accept(int res, uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        if (res == -EINVAL) multishot_accept = false; // pre-5.19 kernel
+        arm_accept();
+    }
+    if (res < 0) {
+        if (res != -EINVAL && res != -EAGAIN && res != -EINTR) LOG_AT(logging::WARN, -res, "accept");
+        return;
+    }
+    if (admission) {
+        // The accept carries no peer address; ask for it only here.
+        struct sockaddr_storage peer;
+        socklen_t len = sizeof(peer);
+        if (getpeername(res, (struct sockaddr*)&peer, &len) < 0) memset(&peer, 0, sizeof(peer));
+        if (!admission->admit_tcp(peer, monotonic_ms())) {
+            reject_busy(res);
+            return;
+        }
+    }
+    UringConn *c = new UringConn(res);
+    active++;
+    metrics::tcp_opened();
+    c->session.start(c->out);
+    step(c);
+}
+
+void TcpUringWorker::on_recv(UringConn *c, int res, uint32_t flags) {
+    c->inflight--;
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        bool kept = res <= 0 || c->in.append(bufs + (size_t)bid * BUF_SIZE, res);
+        provide_buffers(bid, 1);
+        if (!kept) res = -EMSGSIZE; // unterminated input past InputBuffer::MAX_SIZE
+    }
+    if (res == -ENOBUFS) {
+        // Every provided buffer is in use; try again once some come back.
+        starved.push_back(c);
+        return;
+    }
+    if (res == 0 && c->session.streaming()) {
+        // End of a persistent session
+        metrics::session_completed(c->session.variant());
+        LOG_TRACE(c->session.trace_id(), "tcp session {}: closed by client", c->session.trace_id());
+        c->out.clear();
+        queue_send_close(c);
+        return;
+    }
+    if (res == 0 || res == -ECANCELED) {
+        // Peer went away, or the linked timeout fired
+        fail_timeout(c);
+        return;
+    }
+    if (res < 0) {
+        c->out.clear();
+        queue_send_close(c);
+        return;
+    }
+    step(c);
+}
+
+// Feed buffered input to the session and queue whatever comes next. The
+// protocol is strictly request/response, so a connection only ever has a
+// recv or a send outstanding, never both.
+void TcpUringWorker::step(UringConn *c) {
+    c->session.consume(c->in, c->out, TCP_OUT_HIGH_WATER);
+    if (!c->out.empty()) {
+        if (c->session.done()) queue_send_close(c);
+        else queue_send(c);
+    } else {
+        queue_recv(c);
+    }
+}
+
+void TcpUringWorker::on_send(UringConn *c, int res) {
+    c->inflight--;
+    if (c->closing) {
+        release(c);
+        return;
+    }
+    if (res == -ECANCELED) {
+        fail_timeout(c);
+        return;
+    }
+    if (res < 0) {
+        c->out.clear();
+        queue_send_close(c);
+        return;
+    }
+    c->out.consume(res);
+    if (!c->out.empty()) {
+        queue_send(c);
+        return;
+    }
+    step(c);
+}
+
+void TcpUringWorker::on_close(UringConn *c) {
+    c->inflight--;
+    release(c);
+}
+
+bool TcpUringWorker::available() {
+    Uring probe;
+    return probe.setup(8) == 0 && probe.supports_engine_ops();
+}
+
+int TcpUringWorker::run(int lfd) {
+    if (ring.setup(RING_ENTRIES) < 0 || !ring.supports_engine_ops()) return -1;
+    if (posix_memalign((void**)&bufs, 4096, (size_t)NBUFS * BUF_SIZE) != 0) {
+        bufs = NULL;
+        return -1;
+    }
+    listenfd = lfd;
+    if (admission) admission->watch_listener(lfd);
+    provide_buffers(0, NBUFS);
+    arm_accept();
+
+    for (;;) {
+        if (admission && !tick_armed) {
+            int ms = admission->wait_timeout(-1);
+            if (ms >= 0) arm_tick(ms);
+        }
+        if (ring.submit(1) < 0) {
+            LOG_ERROR_ERRNO("io_uring_enter");
+            return 1;
+        }
+        int64_t woke = admission ? monotonic_ms() : 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring.peek_cqe()) != NULL) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+            ring.cqe_seen();
+
+            UringConn *c = (UringConn*)(uintptr_t)(data & ~UD_TAG_MASK);
+            switch (data & UD_TAG_MASK) {
+            case UD_RECV: on_recv(c, res, flags); break;
+            case UD_SEND: on_send(c, res); break;
+            case UD_CLOSE:
+                // A failed send breaks the link and cancels the close.
+                if (res == -ECANCELED) close(c->fd);
+                on_close(c);
+                break;
+            case UD_ACCEPT: on_accept(res, flags); break;
+            case UD_PROVIDE:
+                if (res < 0) LOG_AT(logging::WARN, -res, "provide buffers");
+                break;
+            case UD_TICK: tick_armed = false; break;
+            default: break; // UD_TIMEOUT: fired or cancelled, the guarded op reports it
+            }
+        }
+        if (!starved.empty()) {
+            std::vector<UringConn*> retry;
+            retry.swap(starved);
+            for (size_t i = 0; i < retry.size(); ++i) queue_recv(retry[i]);
+        }
+        if (admission) {
+            int64_t done = monotonic_ms();
+            admission->round(done - woke, done);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+// tcpuring.h
+// io_uring engine for the TCP server, an alternative to the epoll
+// TcpWorker. Uses the raw syscalls (no liburing):
+//   - one multishot accept keeps the listener armed,
+//   - recv draws from a group of kernel-provided buffers,
+//   - every recv/send carries a linked 5 s timeout instead of a timer,
+//   - replies leave as one sendmsg over the output queue's chunks,
+//   - the final reply is a sendmsg linked to its timeout and the close.
+// run() returns -1 before serving anything if the kernel lacks any of the
+// operations, so the caller can fall back to epoll.
+
+#ifndef TCPURING_H
+#define TCPURING_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <linux/io_uring.h>
+
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "inbuf.h"
+#include "outq.h"
+#include "tcpsession.h"
+
+class Uring {
+public:
+    Uring();
+    ~Uring();
+
+    int setup(unsigned entries);
+    // Ops the engine needs, checked through IORING_REGISTER_PROBE.
+    bool supports_engine_ops();
+
+    // Never NULL: submits pending entries to make room if the SQ is full.
+    struct io_uring_sqe *get_sqe();
+    // Submit everything queued and wait for at least wait_nr completions.
+    int submit(unsigned wait_nr);
+
+    // Completion queue access.
+    struct io_uring_cqe *peek_cqe();
+    void cqe_seen();
+
+private:
+    Uring(const Uring&);
+    Uring& operator=(const Uring&);
+
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned to_submit;
+};
+
+struct TcpUringWorker;
+
+struct UringConn {
+    UringConn(int fd) : fd(fd), inflight(0), closing(false) {}
+
+    int fd;
+    TcpSession session;
+    InputBuffer in;
+    OutputQueue out;
+    // The in-flight sendmsg points at these until it completes.
+    struct msghdr msg;
+    struct iovec iov[8];
+    int inflight; // submitted requests whose completion is still due
+    bool closing;
+};
+
+struct TcpUringWorker {
+    TcpUringWorker();
+    ~TcpUringWorker();
+
+    // Serve listenfd forever. Returns -1 straight away if io_uring is
+    // unusable here, 1 on a fatal error later on.
+    int run(int listenfd);
+
+    // Cheap check for the startup banner and engine selection.
+    static bool available();
+
+    static const unsigned RING_ENTRIES = 4096;
+    static const unsigned NBUFS = 1024;   // provided recv buffers
+    static const unsigned BUF_SIZE = 2048;
+    static const unsigned BUF_GROUP = 0;
+
+    // New connections go through it when set (admission.h).
+    Admission *admission;
+
+private:
+    void arm_accept();
+    void provide_buffers(unsigned bid, unsigned count);
+    struct io_uring_sqe *link_timeout();
+    void arm_tick(int ms);
+    void queue_recv(UringConn *c);
+    void prep_send(UringConn *c);
+    void queue_send(UringConn *c);
+    void queue_send_close(UringConn *c);
+    void step(UringConn *c);
+    void fail_timeout(UringConn *c);
+    void release(UringConn *c);
+
+    void on_accept(int res, uint32_t flags);
+    void on_recv(UringConn *c, int res, uint32_t flags);
+    void on_send(UringConn *c, int res);
+    void on_close(UringConn *c);
+
+    Uring ring;
+    int listenfd;
+    char *bufs;
+    long active;
+    bool multishot_accept; // cleared when the kernel refuses it (pre-5.19)
+    bool tick_armed;       // an arm_tick() timeout is pending
+    struct __kernel_timespec tick_ts;
+    std::vector<UringConn*> starved; // recv got -ENOBUFS, retried next round
+};
+
+#endif
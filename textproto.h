@@ -0,0 +1,228 @@
+// textproto.h
+// Parsing and formatting for the text protocols, on string_views and
+// caller supplied buffers: no allocation, no sscanf/snprintf. The
+// scanners keep the sscanf conversions the servers used to run, so what
+// was accepted or rejected before still is:
+//   scan_int    "%d"   leading white space, optional sign, decimal digits;
+//                      out of range values clamp to long and are then
+//                      truncated to int, as glibc does
+//   scan_double "%lf"  leading white space, optional sign, then what
+//                      strtod() takes (decimal, inf, nan)
+//   scan_word   "%s"   leading white space, then a run of non white space
+// Each one consumes what it converted from the front of its argument.
+
+#ifndef TEXTPROTO_H
+#define TEXTPROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <charconv>
+#include <string_view>
+
+namespace textproto {
+
+// isspace() in the C locale.
+inline bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+inline char lower(char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+inline std::string_view skip_space(std::string_view s) {
+    size_t i = 0;
+    while (i < s.size() && is_space(s[i])) ++i;
+    return s.substr(i);
+}
+
+// Drop a trailing "\n", "\r\n", "\r\r\n"...
+inline std::string_view trim_eol(std::string_view s) {
+    while (!s.empty() && (s.back() == '\n' || s.back() == '\r')) s.remove_suffix(1);
+    return s;
+}
+
+// Case-insensitive (ASCII) search for needle, which must be lower case.
+inline size_t ifind(std::string_view hay, std::string_view needle) {
+    if (needle.empty()) return 0;
+    if (hay.size() < needle.size()) return std::string_view::npos;
+    char first = needle[0];
+    char upper = first >= 'a' && first <= 'z' ? first - ('a' - 'A') : first;
+    size_t last = hay.size() - needle.size();
+    for (size_t i = 0; i <= last; ++i) {
+        if (hay[i] != first && hay[i] != upper) continue;
+        size_t k = 1;
+        while (k < needle.size() && lower(hay[i + k]) == needle[k]) ++k;
+        if (k == needle.size()) return i;
+    }
+    return std::string_view::npos;
+}
+
+inline bool scan_int(std::string_view &s, int &out) {
+    std::string_view t = skip_space(s);
+    const char *p = t.data(), *end = p + t.size();
+    const char *num = p;
+    bool neg = false;
+    if (p != end && (*p == '+' || *p == '-')) {
+        neg = *p++ == '-';
+        if (!neg) num = p;  // from_chars takes '-' but not '+'
+    }
+    if (p == end || *p < '0' || *p > '9') return false;
+    long v;
+    std::from_chars_result r = std::from_chars(num, end, v);
+    if (r.ec == std::errc::result_out_of_range) v = neg ? LONG_MIN : LONG_MAX;
+    out = (int)v;
+    s = std::string_view(r.ptr, end - r.ptr);
+    return true;
+}
+
+// What strtod() gives for a decimal that from_chars() found out of
+// range: +-HUGE_VAL when it overflows, +-0 when it underflows. Which one
+// follows from where the first non-zero digit sits plus the exponent.
+inline double out_of_range(const char *p, const char *end) {
+    bool neg = *p == '-';
+    if (neg) ++p;
+    long mag = 0;
+    bool seen = false, point = false;
+    for (; p != end && *p != 'e' && *p != 'E'; ++p) {
+        if (*p == '.') point = true;
+        else if (seen) mag += !point;
+        else if (*p != '0') { seen = true; mag += !point; }
+        else mag -= point;
+    }
+    long exp = 0;
+    if (p != end) {
+        ++p;
+        bool eneg = *p == '-';
+        if (*p == '-' || *p == '+') ++p;
+        for (; p != end && exp < 100000; ++p) exp = exp * 10 + (*p - '0');
+        if (eneg) exp = -exp;
+    }
+    double v = mag + exp > 0 ? HUGE_VAL : 0.0;
+    return neg ? -v : v;
+}
+
+inline bool scan_double(std::string_view &s, double &out) {
+    std::string_view t = skip_space(s);
+    const char *p = t.data(), *end = p + t.size();
+    if (p != end && *p == '+') {
+        ++p;
+        if (p != end && *p == '-') return false;
+    }
+    std::from_chars_result r = std::from_chars(p, end, out);
+    if (r.ec == std::errc::invalid_argument) return false;
+    if (r.ec == std::errc::result_out_of_range) out = out_of_range(p, r.ptr);
+    s = std::string_view(r.ptr, end - r.ptr);
+    return true;
+}
+
+inline bool scan_word(std::string_view &s, std::string_view &word) {
+    std::string_view t = skip_space(s);
+    size_t n = 0;
+    while (n < t.size() && !is_space(t[n])) ++n;
+    if (n == 0) return false;
+    word = t.substr(0, n);
+    s = t.substr(n);
+    return true;
+}
+
+// s with all white space removed into buf, up to the first NUL (where
+// the C string the old code scanned ended). Returns the length, or
+// cap + 1 when it does not fit.
+inline size_t strip_space(std::string_view s, char *buf, size_t cap) {
+    size_t n = 0;
+    for (char c : s) {
+        if (c == '\0') break;
+        if (is_space(c)) continue;
+        if (n == cap) return cap + 1;
+        buf[n++] = c;
+    }
+    return n;
+}
+
+// The 1.1 text answer: white space anywhere is ignored, then an integer,
+// or failing that a floating point value within 0.0001 of expected.
+// answer_int is the integer read, 0 for a floating point answer. The
+// stripped line goes to a local buffer; a line with more than
+// ANSWER_MAX other characters is no answer anybody computed and is
+// rejected rather than copied to the heap.
+static const size_t ANSWER_MAX = 256;
+
+inline bool check_answer(std::string_view in, int32_t expected, int &answer_int) {
+    char local[ANSWER_MAX];
+    answer_int = 0;
+    size_t n = strip_space(in, local, sizeof(local));
+    if (n > sizeof(local)) return false;
+
+    double answer_double = 0.0;
+    std::string_view rest(local, n);
+    if (scan_int(rest, answer_int)) return answer_int == expected;
+    if (scan_double(rest, answer_double)) return fabs(answer_double - expected) < 0.0001;
+    return false;
+}
+
+// The TCP protocol selection line: the first of the four "... ok"
+// phrases found anywhere in it, case-insensitively, in this order. For
+// the 1.2 ones window is the integer after the phrase, if any (1
+// otherwise, and not clamped).
+enum Selection { SEL_NONE, SEL_BINARY_11, SEL_TEXT_11, SEL_BINARY_12, SEL_TEXT_12 };
+
+inline Selection parse_selection(std::string_view line, int &window) {
+    const size_t npos = std::string_view::npos;
+    size_t at;
+    window = 1;
+    if (ifind(line, "binary tcp 1.1 ok") != npos) return SEL_BINARY_11;
+    if (ifind(line, "text tcp 1.1 ok") != npos) return SEL_TEXT_11;
+    Selection sel;
+    std::string_view args;
+    if ((at = ifind(line, "binary tcp 1.2 ok")) != npos) {
+        sel = SEL_BINARY_12;
+        args = line.substr(at + 17);
+    } else if ((at = ifind(line, "text tcp 1.2 ok")) != npos) {
+        sel = SEL_TEXT_12;
+        args = line.substr(at + 15);
+    } else {
+        return SEL_NONE;
+    }
+    if (!scan_int(args, window)) window = 1;
+    return sel;
+}
+
+// The stateless UDP text answer, "<result> <token>": an integer, then a
+// word of exactly token_len characters. The token is not decoded here.
+inline bool parse_token_answer(std::string_view line, size_t token_len, int32_t &result, std::string_view &token) {
+    std::string_view rest = trim_eol(line);
+    return scan_int(rest, result) && scan_word(rest, token) && token.size() == token_len;
+}
+
+// Replies. Buffers must hold the _MAX bytes; nothing is NUL terminated.
+static const size_t OK_LINE_MAX = 32;          // "OK (myresult=-2147483648)\n"
+static const size_t ASSIGNMENT_LINE_MAX = 40;  // "ASSIGNMENT: add -2147483648 -2147483648\n"
+
+inline size_t format_ok_line(char *buf, int32_t result) {
+    static const char head[] = "OK (myresult=";
+    memcpy(buf, head, sizeof(head) - 1);
+    // Leave room for ")\n", an int32 always fits.
+    char *p = std::to_chars(buf + sizeof(head) - 1, buf + OK_LINE_MAX - 2, result).ptr;
+    *p++ = ')';
+    *p++ = '\n';
+    return p - buf;
+}
+
+// op is the three letter operation name.
+inline size_t format_assignment(char *buf, const char *op, int32_t a, int32_t b) {
+    static const char head[] = "ASSIGNMENT: ";
+    char *end = buf + ASSIGNMENT_LINE_MAX;
+    memcpy(buf, head, sizeof(head) - 1);
+    memcpy(buf + sizeof(head) - 1, op, 3);
+    char *p = buf + sizeof(head) - 1 + 3;
+    *p++ = ' ';
+    p = std::to_chars(p, end, a).ptr;
+    *p++ = ' ';
+    p = std::to_chars(p, end, b).ptr;
+    *p++ = '\n';
+    return p - buf;
+}
+
+}
+
+#endif
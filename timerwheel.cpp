@@ -0,0 +1,61 @@
+// timerwheel.cpp
+// Hierarchical timing wheel, see timerwheel.h
+
+#include <string.h>
+
+#include "timerwheel.h"
+
+TimerWheel::TimerWheel(int64_t now_ms) : current(now_ms < 0 ? 0 : (uint64_t)now_ms), count(0) {
+    for (int l = 0; l < LEVELS; ++l)
+        for (int s = 0; s < SLOTS; ++s)
+            wheel[l][s].head.next = wheel[l][s].head.prev = &wheel[l][s].head;
+    overdue.next = overdue.prev = &overdue;
+    memset(occupied, 0, sizeof(occupied));
+}
+
+// Redistribute one slot of `level` into the levels below. Called whenever
+// the level below wraps; recurses upward first so nodes trickle down.
+void TimerWheel::cascade(int level) {
+    if (level >= LEVELS) return;
+    unsigned idx = (unsigned)(current >> (SLOT_BITS * level)) & (SLOTS - 1);
+    if (idx == 0) cascade(level + 1);
+
+    TimerNode *head = &wheel[level][idx].head;
+    if (head->next == head) return;
+    TimerNode pending;
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    head->next = head->prev = head;
+
+    while (pending.next != &pending) {
+        TimerNode *t = pending.next;
+        unlink(t);
+        place(t);
+    }
+}
+
+int TimerWheel::next_timeout(int64_t now_ms) const {
+    if (count == 0) return -1;
+    if (overdue.next != &overdue) return 0;
+    uint64_t now = now_ms < 0 ? 0 : (uint64_t)now_ms;
+    uint64_t at;
+    unsigned idx = (unsigned)current & (SLOTS - 1);
+    if (idx == 0) {
+        // A cascade is pending at this wrap point, nodes may be about to
+        // drop into level 0.
+        at = current;
+    } else {
+        // Earliest occupied level 0 slot at or after current, otherwise
+        // the next cascade point.
+        at = (current | (SLOTS - 1)) + 1;
+        for (unsigned i = idx; i < SLOTS; ++i) {
+            if (occupied[i >> 6] & ((uint64_t)1 << (i & 63))) {
+                at = current + (i - idx);
+                break;
+            }
+        }
+    }
+    return at <= now ? 0 : (int)(at - now);
+}
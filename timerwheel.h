@@ -0,0 +1,166 @@
+// timerwheel.h
+// Hierarchical timing wheel (4 levels x 256 slots) with intrusive nodes.
+// arm() and cancel() are O(1); advance() fires everything that is due in
+// one batch. Time is whatever monotonic millisecond clock the caller
+// drives it with; one tick is one millisecond, so the wheel spans ~49 days.
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Embed (or inherit) this in the object that owns the timeout.
+struct TimerNode {
+    TimerNode() : next(NULL), prev(NULL), expires(0) {}
+    bool armed() const { return next != NULL; }
+
+    TimerNode *next, *prev;
+    uint64_t expires; // absolute tick
+};
+
+class TimerWheel {
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 8;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    explicit TimerWheel(int64_t now_ms);
+
+    // (Re)arm t to fire at absolute time expires_ms. An already armed node
+    // is moved, a deadline in the past fires on the next advance().
+    void arm(TimerNode *t, int64_t expires_ms);
+    void cancel(TimerNode *t);
+
+    // Fire all nodes due at or before now_ms through fire(TimerNode*). The
+    // callback may arm or cancel any node, including other due ones.
+    // Returns the number of nodes fired.
+    template <class F> size_t advance(int64_t now_ms, F fire);
+
+    // Milliseconds until advance() may have work, -1 if nothing is armed.
+    // Never later than the earliest deadline, may be earlier for timers
+    // still sitting in the upper levels.
+    int next_timeout(int64_t now_ms) const;
+
+    size_t size() const { return count; }
+    int64_t now() const { return (int64_t)current; }
+
+private:
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+
+    struct Slot { TimerNode head; };
+
+    void place(TimerNode *t);
+    void cascade(int level);
+    static void link(TimerNode *head, TimerNode *t);
+    static void unlink(TimerNode *t);
+
+    Slot wheel[LEVELS][SLOTS];
+    TimerNode overdue;            // armed with a deadline already passed
+    uint64_t occupied[SLOTS / 64]; // level 0 slots that hold nodes
+    uint64_t current;             // next tick to process
+    size_t count;
+};
+
+inline void TimerWheel::link(TimerNode *head, TimerNode *t) {
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+inline void TimerWheel::unlink(TimerNode *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+inline void TimerWheel::place(TimerNode *t) {
+    if (t->expires < current) {
+        // Already due, the tick it belonged to has been processed.
+        link(&overdue, t);
+        return;
+    }
+    uint64_t when = t->expires;
+    uint64_t delta = when - current;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1)))) level++;
+    unsigned idx = (unsigned)(when >> (SLOT_BITS * level)) & (SLOTS - 1);
+    if (level == LEVELS - 1 &&
+        delta >= ((uint64_t)1 << (SLOT_BITS * LEVELS)) - ((uint64_t)1 << (SLOT_BITS * level))) {
+        // Beyond the wheel's span: park in the farthest slot, it is
+        // re-placed when that slot cascades.
+        idx = (unsigned)((current >> (SLOT_BITS * level)) - 1) & (SLOTS - 1);
+    }
+    link(&wheel[level][idx].head, t);
+    if (level == 0) occupied[idx >> 6] |= (uint64_t)1 << (idx & 63);
+}
+
+inline void TimerWheel::arm(TimerNode *t, int64_t expires_ms) {
+    if (t->armed()) unlink(t);
+    else count++;
+    t->expires = expires_ms < 0 ? 0 : (uint64_t)expires_ms;
+    place(t);
+}
+
+inline void TimerWheel::cancel(TimerNode *t) {
+    if (!t->armed()) return;
+    unlink(t);
+    count--;
+}
+
+template <class F>
+size_t TimerWheel::advance(int64_t now_ms, F fire) {
+    size_t fired = 0;
+    uint64_t target = now_ms < 0 ? 0 : (uint64_t)now_ms;
+    while (overdue.next != &overdue) {
+        TimerNode *t = overdue.next;
+        unlink(t);
+        count--;
+        fired++;
+        fire(t);
+    }
+    while (current <= target) {
+        unsigned idx = (unsigned)current & (SLOTS - 1);
+        if (idx == 0) cascade(1);
+
+        // Skip ahead over empty level 0 slots, but never past a cascade
+        // point or the target.
+        if (!(occupied[idx >> 6] & ((uint64_t)1 << (idx & 63)))) {
+            unsigned next = idx + 1;
+            while (next < SLOTS && !(occupied[next >> 6] & ((uint64_t)1 << (next & 63)))) {
+                if ((next & 63) == 0 && occupied[next >> 6] == 0) next += 64;
+                else next++;
+            }
+            uint64_t jump = current + (next - idx);
+            current = jump > target + 1 ? target + 1 : jump;
+            continue;
+        }
+
+        // Detach the slot into a local list so callbacks can re-arm freely.
+        TimerNode due;
+        due.next = due.prev = &due;
+        TimerNode *head = &wheel[0][idx].head;
+        if (head->next != head) {
+            due.next = head->next;
+            due.prev = head->prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            head->next = head->prev = head;
+        }
+        occupied[idx >> 6] &= ~((uint64_t)1 << (idx & 63));
+        current++;
+
+        while (due.next != &due) {
+            TimerNode *t = due.next;
+            unlink(t);
+            count--;
+            fired++;
+            fire(t);
+        }
+    }
+    return fired;
+}
+
+#endif
@@ -0,0 +1,548 @@
+// udpengine.cpp
+// Batched datagram pipeline for the UDP server - replies binary error
+// messages for malformed binary input, same as the old single-shot loop.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string_view>
+
+#include "udpengine.h"
+#include "siphash.h"
+#include "wirecodec.h"
+#include "textproto.h"
+#include "assignpool.h"
+#include "metrics.h"
+#include "log.h"
+extern "C" {
+#include "calcLib.h"
+}
+
+using namespace std;
+
+typedef wire::CalcProtocol CP;
+typedef wire::CalcMessage CM;
+
+static int64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Stateless cookies. Binary: id = issue second (low 8 bits) << 24 | 24
+// bits of MAC over peer, arith, operands and the whole issue second; the
+// verifier recovers that second as the latest one with those low bits,
+// so a cookie replayed 256 s or more later no longer matches. Text: a
+// 40 hex digit token = 12 byte payload (op << 30 | issue second mod 2^30,
+// a, b; big endian) + 8 byte MAC over peer and payload, appended to the
+// assignment and echoed by the client after its result.
+static const uint32_t TEXT_TIME_MASK = 0x3fffffff;
+static const size_t TOKEN_HEX = 40;
+
+static bool is_printable(const char *buf, ssize_t n) {
+    for (ssize_t i = 0; i < n; ++i) {
+        unsigned char c = (unsigned char)buf[i];
+        if (c < 9 || (c > 13 && c < 32) || c == 127) return false;
+    }
+    return true;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool is_valid_binary_protocol(const calcProtocol &cp) {
+    if (cp.major_version != 1 || cp.minor_version != 1) return false;
+    if (cp.type == 0 && cp.id == 0 && cp.arith == 0 && cp.inValue1 == 0 && cp.inValue2 == 0 && cp.inResult == 0) return false;
+    return true;
+}
+
+static metrics::Variant variant_of(const ClientState *cs) {
+    if (!cs) return metrics::NONE;
+    return cs->is_binary ? metrics::BINARY_UDP : metrics::TEXT_UDP;
+}
+
+// The verdict on an answer; elapsed_ns < 0 when there is no assignment
+// time to measure from (stateless mode).
+static void answered(metrics::Variant v, bool ok, int64_t elapsed_ns) {
+    metrics::verdict(v, ok ? metrics::OK : metrics::NOT_OK);
+    metrics::session_completed(v);
+    if (elapsed_ns >= 0) metrics::answer_time(v, elapsed_ns);
+}
+
+UdpWorker::UdpWorker(int batch, size_t expected_clients)
+    : packets(0), replies(0), unsent(0), admission(NULL), fd(-1), batch(batch),
+      clients(expected_clients, calcRngNext(calcRngThread())),
+      next_gen(0), now(monotonic_ms()), now_ns(0), stateless(false), wall(0),
+      tx_count(0), cur_addr(NULL), cur_addrlen(0) {
+    memset(cookie_key, 0, sizeof(cookie_key));
+    if (this->batch < 1) this->batch = 1;
+    if (this->batch > MAX_BATCH) this->batch = MAX_BATCH;
+    int n = this->batch;
+
+    rx_data.resize((size_t)n * DGRAM_MAX);
+    rx_addr.resize(n);
+    rx_iov.resize(n);
+    rx_msgs.resize(n);
+    // Every datagram gets at most one reply, so the send side needs as
+    // many slots as the receive side.
+    tx_data.resize((size_t)n * REPLY_MAX);
+    tx_addr.resize(n);
+    tx_iov.resize(n);
+    tx_msgs.resize(n);
+    for (int i = 0; i < n; ++i) {
+        rx_iov[i].iov_base = &rx_data[(size_t)i * DGRAM_MAX];
+        rx_iov[i].iov_len = DGRAM_MAX;
+        tx_iov[i].iov_base = &tx_data[(size_t)i * REPLY_MAX];
+    }
+}
+
+int UdpWorker::run_batch(int sockfd) {
+    fd = sockfd;
+    for (int i = 0; i < batch; ++i) {
+        memset(&rx_msgs[i], 0, sizeof(rx_msgs[i]));
+        rx_msgs[i].msg_hdr.msg_name = &rx_addr[i];
+        rx_msgs[i].msg_hdr.msg_namelen = sizeof(rx_addr[i]);
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int got = recvmmsg(fd, rx_msgs.data(), batch, MSG_DONTWAIT, NULL);
+    if (got < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        LOG_ERROR_ERRNO("recvmmsg");
+        return -1;
+    }
+
+    // One clock read per batch.
+    now_ns = metrics::now_ns();
+    now = now_ns / 1000000;
+    if (stateless) wall = (uint32_t)time(NULL);
+    tx_count = 0;
+    for (int i = 0; i < got; ++i) {
+        ssize_t n = rx_msgs[i].msg_len;
+        if (n <= 0) continue;
+        cur_addr = &rx_addr[i];
+        cur_addrlen = rx_msgs[i].msg_hdr.msg_namelen;
+        handle((const char*)rx_iov[i].iov_base, n, rx_addr[i]);
+    }
+    packets.fetch_add(got, std::memory_order_relaxed);
+    flush();
+    metrics::udp_clients(clients.size());
+    return got;
+}
+
+void UdpWorker::reply(const void *data, size_t len) {
+    if (tx_count >= batch || len > REPLY_MAX) return;
+    int i = tx_count++;
+    memcpy(tx_iov[i].iov_base, data, len);
+    tx_iov[i].iov_len = len;
+    memcpy(&tx_addr[i], cur_addr, cur_addrlen);
+    memset(&tx_msgs[i], 0, sizeof(tx_msgs[i]));
+    tx_msgs[i].msg_hdr.msg_name = &tx_addr[i];
+    tx_msgs[i].msg_hdr.msg_namelen = cur_addrlen;
+    tx_msgs[i].msg_hdr.msg_iov = &tx_iov[i];
+    tx_msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+void UdpWorker::reply_calcMessage(uint32_t message) {
+    calcMessage m;
+    m.type = 2;
+    m.message = message;
+    m.protocol = 17;
+    m.major_version = 1;
+    m.minor_version = 1;
+    unsigned char buf[CM::SIZE];
+    CM::encode(buf, m);
+    reply(buf, CM::SIZE);
+}
+
+// Push out the replies queued by the batch. A short sendmmsg() means the
+// first unsent datagram failed. A full socket buffer fails the rest the
+// same way, so they are dropped together; any other error is that
+// datagram's own (UDP may drop it anyway), skip it and go on with the
+// rest rather than stalling the receive side.
+void UdpWorker::flush() {
+    int off = 0;
+    uint64_t sent = 0;
+    while (off < tx_count) {
+        int s = sendmmsg(fd, &tx_msgs[off], tx_count - off, MSG_DONTWAIT);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) break;
+            s = 0;
+        }
+        sent += s;
+        off += s + 1;
+    }
+    replies.fetch_add(sent, std::memory_order_relaxed);
+    if (sent < (uint64_t)tx_count) unsent.fetch_add(tx_count - sent, std::memory_order_relaxed);
+    tx_count = 0;
+}
+
+void UdpWorker::expire() {
+    now = monotonic_ms();
+    while (!expiry.empty() && expiry.front().expires <= now) {
+        const ExpiryEntry &e = expiry.front();
+        ClientState *cs = clients.find(e.key);
+        if (cs && cs->gen == e.gen) clients.erase(cs);
+        expiry.pop_front();
+    }
+    metrics::udp_clients(clients.size());
+}
+
+// Admission for a hello from key; the state it would add is one table
+// slot (or the next doubling) and one expiry entry.
+bool UdpWorker::admit_hello(const ClientAddr &key) {
+    if (!admission) return true;
+    size_t bytes = 0;
+    if (!stateless) {
+        size_t table = ClientTable<ClientState>::bytes_for(clients.size() + 1);
+        if (table < clients.bytes()) table = clients.bytes();
+        bytes = table + (expiry.size() + 1) * sizeof(ExpiryEntry);
+    }
+    return admission->admit_udp(bytes, key, now);
+}
+
+void UdpWorker::add_client(const ClientAddr &key, ClientState &cs, int64_t deadline_ms) {
+    cs.gen = ++next_gen;
+    cs.deadline = now + deadline_ms;
+    *clients.insert(key) = cs;
+    ExpiryEntry e;
+    e.key = key;
+    e.gen = cs.gen;
+    e.expires = now + RETAIN_MS;
+    expiry.push_back(e);
+}
+
+void UdpWorker::set_stateless(const uint8_t key[16]) {
+    stateless = true;
+    memcpy(cookie_key, key, sizeof(cookie_key));
+}
+
+uint32_t UdpWorker::binary_cookie(const ClientAddr &key, uint32_t arith, int32_t a, int32_t b, uint32_t issued) const {
+    unsigned char msg[sizeof(ClientAddr) + 16];
+    memcpy(msg, &key, sizeof(key));
+    unsigned char *p = msg + sizeof(key);
+    wire::store_be<uint32_t>(p + 0, arith);
+    wire::store_be<uint32_t>(p + 4, (uint32_t)a);
+    wire::store_be<uint32_t>(p + 8, (uint32_t)b);
+    wire::store_be<uint32_t>(p + 12, issued);
+    uint64_t mac = siphash24(cookie_key, msg, sizeof(msg));
+    return (issued & 0xff) << 24 | (uint32_t)(mac & 0xffffff);
+}
+
+uint64_t UdpWorker::text_mac(const ClientAddr &key, const unsigned char payload[12]) const {
+    unsigned char msg[sizeof(ClientAddr) + 12];
+    memcpy(msg, &key, sizeof(key));
+    memcpy(msg + sizeof(key), payload, 12);
+    return siphash24(cookie_key, msg, sizeof(msg));
+}
+
+void UdpWorker::handle_stateless(const char *buf, ssize_t n, const ClientAddr &key) {
+    if (n == (ssize_t)CP::SIZE) {
+        calcProtocol cp;
+        CP::decode(buf, cp);
+        uint32_t age = (wall - (cp.id >> 24)) & 0xff;
+        if (!is_valid_binary_protocol(cp) || cp.arith < 1 || cp.arith > 4 ||
+            binary_cookie(key, cp.arith, cp.inValue1, cp.inValue2, wall - age) != cp.id) {
+            metrics::verdict(metrics::BINARY_UDP, metrics::ERROR);
+            reply_calcMessage(2);
+            return;
+        }
+        bool ok = age <= BINARY_DEADLINE_MS / 1000 &&
+                  (int32_t)cp.inResult == calcEvaluate(cp.arith, cp.inValue1, cp.inValue2);
+        answered(metrics::BINARY_UDP, ok, -1);
+        reply_calcMessage(ok ? 1 : 2);
+        return;
+    }
+
+    if (n == (ssize_t)CM::SIZE) {
+        if (CM::get<&calcMessage::type>(buf) != 22 || CM::get<&calcMessage::protocol>(buf) != 17) {
+            metrics::verdict(metrics::NONE, metrics::ERROR);
+            reply_calcMessage(2);
+            return;
+        }
+        if (!admit_hello(key)) return;
+        metrics::session_started(metrics::BINARY_UDP);
+        Assignment as;
+        next_assignment(as);
+        as.stamp(binary_cookie(key, as.arith, as.v1, as.v2, wall));
+        reply(as.binary, Assignment::BINARY_SIZE);
+        return;
+    }
+
+    if (!is_printable(buf, n)) {
+        metrics::verdict(metrics::NONE, metrics::ERROR);
+        reply_calcMessage(2);
+        return;
+    }
+
+    std::string_view s = textproto::trim_eol(std::string_view(buf, n));
+
+    unsigned char token[20];
+    if (s == "TEXT UDP 1.1") {
+        if (!admit_hello(key)) return;
+        metrics::session_started(metrics::TEXT_UDP);
+        Assignment as;
+        next_assignment(as);
+        wire::store_be<uint32_t>(token + 0, (as.arith - 1) << 30 | (wall & TEXT_TIME_MASK));
+        wire::store_be<uint32_t>(token + 4, (uint32_t)as.v1);
+        wire::store_be<uint32_t>(token + 8, (uint32_t)as.v2);
+        uint64_t mac = text_mac(key, token);
+        for (int i = 0; i < 8; ++i) token[12 + i] = (unsigned char)(mac >> (56 - 8 * i));
+
+        // "add 12 34 <token>\n"
+        static const char digits[] = "0123456789abcdef";
+        char outmsg[REPLY_MAX];
+        size_t len = as.op_line_len() - 1;
+        memcpy(outmsg, as.op_line(), len);
+        outmsg[len++] = ' ';
+        for (size_t i = 0; i < sizeof(token); ++i) {
+            outmsg[len++] = digits[token[i] >> 4];
+            outmsg[len++] = digits[token[i] & 15];
+        }
+        outmsg[len++] = '\n';
+        reply(outmsg, len);
+        return;
+    }
+
+    // "<result> <token>"
+    int32_t res = 0;
+    std::string_view hex;
+    if (!textproto::parse_token_answer(s, TOKEN_HEX, res, hex)) {
+        metrics::verdict(metrics::NONE, metrics::ERROR);
+        reply("ERROR\n", 6);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(token); ++i) {
+        int hi = hex_value(hex[2 * i]), lo = hex_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            metrics::verdict(metrics::TEXT_UDP, metrics::ERROR);
+            reply("ERROR\n", 6);
+            return;
+        }
+        token[i] = (unsigned char)(hi << 4 | lo);
+    }
+    uint64_t mac = text_mac(key, token);
+    for (int i = 0; i < 8; ++i) {
+        if (token[12 + i] != (unsigned char)(mac >> (56 - 8 * i))) {
+            metrics::verdict(metrics::TEXT_UDP, metrics::ERROR);
+            reply("ERROR\n", 6);
+            return;
+        }
+    }
+    uint32_t head = wire::load_be<uint32_t>(token);
+    uint32_t age = (wall - head) & TEXT_TIME_MASK;
+    int32_t expected = calcEvaluate((head >> 30) + 1, wire::load_be<int32_t>(token + 4), wire::load_be<int32_t>(token + 8));
+    bool ok = age <= TEXT_DEADLINE_MS / 1000 && res == expected;
+    answered(metrics::TEXT_UDP, ok, -1);
+    if (ok) reply("OK\n", 3);
+    else reply("NOT OK\n", 7);
+}
+
+void UdpWorker::handle(const char *buf, ssize_t n, const struct sockaddr_storage &cliaddr) {
+    ClientAddr key = client_addr(cliaddr);
+    if (stateless) {
+        handle_stateless(buf, n, key);
+        return;
+    }
+    ClientState *it = clients.find(key);
+    bool client_exists = (it != NULL);
+
+    // If message size is neither calcProtocol nor calcMessage, test whether printable text
+    if (n != (ssize_t)CP::SIZE && n != (ssize_t)CM::SIZE) {
+        if (!is_printable(buf, n)) {
+            // Malformed binary/intermediate size -> reply binary NOT-OK (calcMessage with message=2)
+            metrics::verdict(variant_of(it), metrics::ERROR);
+            reply_calcMessage(2);
+            return;
+        }
+        // else treat as text protocol ..
+    }
+
+    // Try binary (calcProtocol)
+    if (n == (ssize_t)CP::SIZE) {
+        // Parse calcProtocol from wire buffer
+        calcProtocol cp_host;
+        CP::decode(buf, cp_host);
+
+        // Empty/invalid binary hello -> send binary error
+        if (!client_exists && !is_valid_binary_protocol(cp_host)) {
+            metrics::verdict(metrics::NONE, metrics::ERROR);
+            reply_calcMessage(2);
+            return;
+        }
+
+        if (!client_exists) {
+            // This is a response from a client that has already been timed out and removed.
+            // The client is sending a valid calcProtocol, but we don't have a state for it.
+            // Instead of treating it as a new client, we should ignore it to prevent errors.
+            return;
+        }
+        // Existing binary client: validate answer
+        ClientState &cs = *it;
+        bool ok;
+        if (cp_host.id != cs.task_id) {
+            ok = false;
+        } else if (now > cs.deadline) {
+            ok = false;
+        } else {
+            int32_t received_result = (int32_t)cp_host.inResult;
+            ok = received_result == cs.expected;
+        }
+        answered(variant_of(it), ok, now_ns - cs.assigned);
+        LOG_TRACE(cs.trace, "udp client {}: answer ok={} after {} us", cs.trace, ok, (now_ns - cs.assigned) / 1000);
+        reply_calcMessage(ok ? 1 : 2);
+        clients.erase(it);
+        return;
+    }
+
+    // If size matches calcMessage (binary), parse/wrap behavior:
+    if (n == (ssize_t)CM::SIZE) {
+        calcMessage m;
+        CM::decode(buf, m);
+        uint16_t m_type = m.type;
+        uint32_t m_message = m.message;
+        uint16_t m_protocol = m.protocol;
+        uint16_t m_maj = m.major_version;
+        uint16_t m_min = m.minor_version;
+
+        // If it's a truly empty calcMessage, respond with binary NOT-OK
+        if (!client_exists && m_type == 0 && m_message == 0 && m_protocol == 0 && m_maj == 0 && m_min == 0) {
+            metrics::verdict(metrics::NONE, metrics::ERROR);
+            reply_calcMessage(2);
+            return;
+        }
+
+        // If this is a registration / hello (non-empty calcMessage) and new client, treat as binary hello
+        if (!client_exists) {
+            // Stricter check for binary hello based on protocol description
+            if (m_type == 22 && m_protocol == 17) {
+                if (!admit_hello(key)) return;
+                ClientState cs{}; cs.is_binary = true; cs.waiting = true;
+                Assignment as;
+                next_assignment(as);
+                uint32_t id = (uint32_t)calcRngNext(calcRngThread());
+                cs.task_id = id; cs.expected = as.expected; cs.v1 = as.v1; cs.v2 = as.v2; cs.arith = as.arith;
+                cs.assigned = now_ns;
+                cs.trace = logging::sample_session();
+                add_client(key, cs, BINARY_DEADLINE_MS);
+                metrics::session_started(metrics::BINARY_UDP);
+                LOG_TRACE(cs.trace, "udp client {}: binary hello, task {}", cs.trace, id);
+
+                as.stamp(id);
+                reply(as.binary, Assignment::BINARY_SIZE);
+            } else {
+                // Not a valid binary hello, treat as malformed
+                metrics::verdict(metrics::NONE, metrics::ERROR);
+                reply_calcMessage(2);
+            }
+            return;
+        }
+
+        // Client exists and sent a calcMessage mid-dialog, it's unexpected for binary flow -> reply binary NOT-OK
+        // do not erase client here; wait for proper response
+        metrics::verdict(variant_of(it), metrics::ERROR);
+        reply_calcMessage(2);
+        return;
+    }
+
+    // Text protocol handling
+    std::string_view s = textproto::trim_eol(std::string_view(buf, n));
+
+    if (!client_exists) {
+        // New text client. The first message from a text client must be "TEXT UDP 1.1".
+        if (s == "TEXT UDP 1.1") {
+            if (!admit_hello(key)) return;
+            // New text client: send task (text)
+            ClientState cs{}; cs.is_binary = false; cs.waiting = true;
+            Assignment as;
+            next_assignment(as);
+            cs.expected = as.expected; cs.v1 = as.v1; cs.v2 = as.v2; cs.arith = as.arith;
+            cs.assigned = now_ns;
+            cs.trace = logging::sample_session();
+            add_client(key, cs, TEXT_DEADLINE_MS);
+            metrics::session_started(metrics::TEXT_UDP);
+            LOG_TRACE(cs.trace, "udp client {}: text hello", cs.trace);
+
+            reply(as.op_line(), as.op_line_len());
+        } else {
+            // This is a malformed request (wrong version, rubbish, or late answer). Send error.
+            metrics::verdict(metrics::NONE, metrics::ERROR);
+            reply("ERROR\n", 6);
+        }
+        return;
+    }
+
+    // Existing text client: parse "result"
+    ClientState &cs = *it;
+    int32_t res = 0;
+    if (textproto::scan_int(s, res)) {
+        bool ok = now <= cs.deadline && res == cs.expected;
+        answered(metrics::TEXT_UDP, ok, now_ns - cs.assigned);
+        LOG_TRACE(cs.trace, "udp client {}: answer ok={} after {} us", cs.trace, ok, (now_ns - cs.assigned) / 1000);
+        if (ok) reply("OK\n", 3);
+        else reply("NOT OK\n", 7);
+        clients.erase(it);
+    } else {
+        metrics::verdict(metrics::TEXT_UDP, metrics::ERROR);
+        reply("ERROR\n", 6);
+    }
+}
+
+void UdpSocketHandler::on_event(uint32_t) {
+    for (int round = 0; round < 16; ++round) {
+        int got = w->run_batch(fd);
+        if (got < batch) break;
+    }
+}
+
+int UdpService::attach(Reactor &reactor, const std::vector<int> &socks) {
+    if (expiry.fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    handlers.reserve(socks.size());
+    for (int fd : socks) {
+        if (worker->admission) worker->admission->watch_datagram(fd);
+        handlers.push_back(UdpSocketHandler(worker, fd, batch));
+        if (reactor.add(fd, EPOLLIN, &handlers.back()) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+    if (reactor.add(expiry.fd, EPOLLIN, &expiry) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+void UdpService::after_dispatch() {
+    if (expiry.fired) {
+        expiry.fired = false;
+        expiry.armed = -1;
+        worker->expire();
+    }
+    int64_t next = worker->next_expiry();
+    if (next != expiry.armed) expiry.arm(next);
+}
+
+bool parse_cookie_key(const char *hex, uint8_t key[16]) {
+    if (strlen(hex) != 32) return false;
+    for (int i = 0; i < 16; ++i) {
+        unsigned v;
+        if (!isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1])) return false;
+        if (sscanf(hex + 2 * i, "%2x", &v) != 1) return false;
+        key[i] = (uint8_t)v;
+    }
+    return true;
+}
@@ -0,0 +1,168 @@
+// udpengine.h
+// Datagram side of the UDP server. A UdpWorker owns the state of the
+// clients talking to its sockets and processes traffic in batches: one
+// recvmmsg() drains up to `batch` datagrams, each is classified and
+// answered into a reply slot, and one sendmmsg() flushes all replies.
+// A UdpService puts a worker's sockets and its expiry timer on a Reactor,
+// which may be shared with the TCP engine (calcserver).
+
+#ifndef UDPENGINE_H
+#define UDPENGINE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "protocol.h"
+#include "admission.h"
+#include "clienttable.h"
+#include "reactor.h"
+
+struct ClientState {
+    uint32_t task_id = 0;
+    int32_t expected = 0;
+    int32_t v1 = 0, v2 = 0;
+    uint32_t arith = 0;
+    uint32_t gen = 0;       // matches the client's ExpiryEntry
+    int64_t deadline = 0;   // monotonic ms; answers after this are late
+    int64_t assigned = 0;   // monotonic ns, for the answer time
+    bool waiting = false;
+    bool is_binary = false;
+    uint32_t trace = 0;     // logging::sample_session(), 0 = not traced
+};
+
+// Clients are dropped a fixed time after their assignment, so expiry is a
+// FIFO: entries are queued in deadline order and popped from the front.
+// An entry whose client has since answered (or been replaced) no longer
+// matches the table's generation and is just discarded.
+struct ExpiryEntry {
+    ClientAddr key;
+    uint32_t gen;
+    int64_t expires;
+};
+
+class UdpWorker {
+public:
+    static const int64_t BINARY_DEADLINE_MS = 10000;
+    static const int64_t TEXT_DEADLINE_MS = 60000;
+    // How long an unanswered client is remembered. Late binary answers
+    // within this window still get NOT OK instead of silence.
+    static const int64_t RETAIN_MS = 60000;
+
+    static const int MAX_BATCH = 1024;
+    static const size_t DGRAM_MAX = 1024;  // largest datagram we read
+    static const size_t REPLY_MAX = 128;   // largest reply we send
+
+    // expected_clients pre-sizes the client table.
+    UdpWorker(int batch, size_t expected_clients);
+
+    // One recvmmsg/process/sendmmsg round on fd; replies leave through the
+    // socket the datagrams came in on. Returns the number of datagrams
+    // handled (0 if none were waiting), -1 on a socket error.
+    int run_batch(int fd);
+
+    // Drop clients whose retention ran out. Costs O(entries due).
+    void expire();
+    // Monotonic ms at which expire() next has work, -1 if never.
+    int64_t next_expiry() const { return expiry.empty() ? -1 : expiry.front().expires; }
+
+    // Stateless mode: no client table. Binary task ids and text tokens
+    // carry the issue time and a SipHash MAC under key, so any worker
+    // holding the same key can verify an answer. A captured answer can be
+    // replayed until its deadline runs out, not after: a binary id carries
+    // only the low 8 bits of the second, but the MAC covers all of it.
+    void set_stateless(const uint8_t key[16]);
+
+    // Written by the owning thread only, read by whoever reports.
+    std::atomic<uint64_t> packets;  // datagrams received
+    std::atomic<uint64_t> replies;  // datagrams sent
+    std::atomic<uint64_t> unsent;   // replies dropped on send errors
+
+    // New clients go through it when set (admission.h).
+    Admission *admission;
+
+private:
+    void handle(const char *buf, ssize_t n, const struct sockaddr_storage &cliaddr);
+    void add_client(const ClientAddr &key, ClientState &cs, int64_t deadline_ms);
+    bool admit_hello(const ClientAddr &key);
+    void handle_stateless(const char *buf, ssize_t n, const ClientAddr &key);
+    uint32_t binary_cookie(const ClientAddr &key, uint32_t arith, int32_t a, int32_t b, uint32_t issued) const;
+    uint64_t text_mac(const ClientAddr &key, const unsigned char payload[12]) const;
+
+    // Queue a reply to the datagram being handled.
+    void reply(const void *data, size_t len);
+    void reply_calcMessage(uint32_t message);
+    void flush();
+
+    int fd;        // socket of the batch in flight
+    int batch;
+    ClientTable<ClientState> clients;
+    std::deque<ExpiryEntry> expiry;
+    uint32_t next_gen;
+    int64_t now;   // monotonic ms, refreshed once per batch
+    int64_t now_ns; // the same clock read in ns
+    bool stateless;
+    uint8_t cookie_key[16];
+    uint32_t wall; // realtime seconds for cookies, refreshed once per batch
+
+    // Receive side, one slot per datagram.
+    std::vector<char> rx_data;
+    std::vector<struct sockaddr_storage> rx_addr;
+    std::vector<struct iovec> rx_iov;
+    std::vector<struct mmsghdr> rx_msgs;
+
+    // Send side, filled while the batch is processed.
+    std::vector<char> tx_data;
+    std::vector<struct sockaddr_storage> tx_addr;
+    std::vector<struct iovec> tx_iov;
+    std::vector<struct mmsghdr> tx_msgs;
+    int tx_count;
+    const struct sockaddr_storage *cur_addr; // sender of the datagram being handled
+    socklen_t cur_addrlen;
+};
+
+// 32 hex digits -> 16 byte cookie key, so instances can share one.
+bool parse_cookie_key(const char *hex, uint8_t key[16]);
+
+// Readiness on one of a worker's sockets: drain it in batches. Full
+// batches are drained back to back, but only for a few rounds so the
+// other sockets and the timers get their turn; epoll is level triggered
+// and reports the socket again if data is left.
+class UdpSocketHandler : public EventHandler {
+public:
+    UdpSocketHandler(UdpWorker *w, int fd, int batch) : w(w), fd(fd), batch(batch) {}
+    void on_event(uint32_t events);
+
+private:
+    UdpWorker *w;
+    int fd;
+    int batch;
+};
+
+// A worker's sockets and expiry timerfd on the caller's reactor. The
+// timer is armed to the oldest client's deadline, so an idle worker does
+// not wake up; after_dispatch() must run after every round of dispatch.
+class UdpService {
+public:
+    UdpService(UdpWorker *w, int batch) : worker(w), batch(batch) {}
+
+    // Register socks and the timer; -1 on error.
+    int attach(Reactor &reactor, const std::vector<int> &socks);
+    // Expire clients if the timer fired and re-arm it.
+    void after_dispatch();
+
+private:
+    UdpService(const UdpService&);
+    UdpService& operator=(const UdpService&);
+
+    UdpWorker *worker;
+    int batch;
+    std::vector<UdpSocketHandler> handlers; // the reactor keeps pointers into it
+    TimerFd expiry;
+};
+
+#endif
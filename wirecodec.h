@@ -0,0 +1,135 @@
+// wirecodec.h
+// Network byte order codec for the protocol.h messages. Each message
+// layout is listed once, as the sequence of its fields; sizes and
+// offsets are computed at compile time and checked against the packed
+// structs. Fields are read and written with unaligned loads/stores plus
+// a byte swap, so a frame can be decoded, or a single field read, right
+// out of a receive buffer.
+
+#ifndef WIRECODEC_H
+#define WIRECODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "protocol.h"
+
+namespace wire {
+
+template <class T> inline T bswap(T v) {
+    static_assert(std::is_integral<T>::value, "wire fields are integers");
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return v;
+#else
+    typedef typename std::make_unsigned<T>::type U;
+    if (sizeof(T) == 1) return v;
+    if (sizeof(T) == 2) return (T)__builtin_bswap16((U)v);
+    if (sizeof(T) == 4) return (T)__builtin_bswap32((U)v);
+    return (T)__builtin_bswap64((U)v);
+#endif
+}
+
+// Big endian value at p, no alignment needed.
+template <class T> inline T load_be(const void *p) {
+    T v;
+    memcpy(&v, p, sizeof(v));
+    return bswap(v);
+}
+
+template <class T> inline void store_be(void *p, T v) {
+    v = bswap(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+// One field of a message: a pointer to the struct member.
+template <auto M> struct Field;
+template <class S, class T, T S::*M> struct Field<M> {
+    typedef S owner;
+    typedef T type;
+};
+
+// A message laid out as Ms... back to back, in that order.
+template <auto... Ms> class Layout {
+    typedef std::tuple_element_t<0, std::tuple<typename Field<Ms>::owner...> > S_;
+
+    static_assert((std::is_same<typename Field<Ms>::owner, S_>::value && ...), "all fields of one struct");
+    static constexpr size_t sizes[] = { sizeof(typename Field<Ms>::type)... };
+
+    template <auto M> static constexpr size_t index() {
+        constexpr bool match[] = { std::is_same<Field<M>, Field<Ms> >::value... };
+        size_t i = 0;
+        while (i < sizeof...(Ms) && !match[i]) ++i;
+        return i;
+    }
+
+    template <size_t... I> static void decode_all(const unsigned char *p, S_ &s, std::index_sequence<I...>) {
+        ((s.*Ms = load_be<typename Field<Ms>::type>(p + offset_at(I))), ...);
+    }
+    template <size_t... I> static void encode_all(unsigned char *p, const S_ &s, std::index_sequence<I...>) {
+        (store_be<typename Field<Ms>::type>(p + offset_at(I), s.*Ms), ...);
+    }
+
+public:
+    typedef S_ Struct;
+    static constexpr size_t SIZE = (sizeof(typename Field<Ms>::type) + ...);
+
+    static constexpr size_t offset_at(size_t i) {
+        size_t off = 0;
+        for (size_t k = 0; k < i; ++k) off += sizes[k];
+        return off;
+    }
+
+    template <auto M> static constexpr size_t offset() {
+        static_assert(index<M>() < sizeof...(Ms), "field is not part of this layout");
+        return offset_at(index<M>());
+    }
+
+    // One field straight from / into a frame.
+    template <auto M> static typename Field<M>::type get(const void *frame) {
+        return load_be<typename Field<M>::type>((const unsigned char*)frame + offset<M>());
+    }
+    template <auto M> static void put(void *frame, typename Field<M>::type v) {
+        store_be<typename Field<M>::type>((unsigned char*)frame + offset<M>(), v);
+    }
+
+    static void decode(const void *frame, Struct &s) {
+        decode_all((const unsigned char*)frame, s, std::index_sequence_for<decltype(Ms)...>());
+    }
+    static void encode(void *frame, const Struct &s) {
+        encode_all((unsigned char*)frame, s, std::index_sequence_for<decltype(Ms)...>());
+    }
+
+    // n frames packed back to back at SIZE bytes each.
+    static void decode_batch(const void *frames, size_t n, Struct *out) {
+        const unsigned char *p = (const unsigned char*)frames;
+        for (size_t i = 0; i < n; ++i, p += SIZE) decode(p, out[i]);
+    }
+    static void encode_batch(void *frames, size_t n, const Struct *in) {
+        unsigned char *p = (unsigned char*)frames;
+        for (size_t i = 0; i < n; ++i, p += SIZE) encode(p, in[i]);
+    }
+};
+
+typedef Layout<&calcProtocol::type, &calcProtocol::major_version, &calcProtocol::minor_version,
+               &calcProtocol::id, &calcProtocol::arith, &calcProtocol::inValue1,
+               &calcProtocol::inValue2, &calcProtocol::inResult> CalcProtocol;
+
+typedef Layout<&calcMessage::type, &calcMessage::message, &calcMessage::protocol,
+               &calcMessage::major_version, &calcMessage::minor_version> CalcMessage;
+
+// The structs are packed, so the wire layout is the in-memory one.
+static_assert(CalcProtocol::SIZE == 26 && sizeof(calcProtocol) == CalcProtocol::SIZE, "calcProtocol is 26 bytes");
+static_assert(CalcMessage::SIZE == 12 && sizeof(calcMessage) == CalcMessage::SIZE, "calcMessage is 12 bytes");
+static_assert(CalcProtocol::offset<&calcProtocol::id>() == offsetof(calcProtocol, id), "calcProtocol.id");
+static_assert(CalcProtocol::offset<&calcProtocol::arith>() == offsetof(calcProtocol, arith), "calcProtocol.arith");
+static_assert(CalcProtocol::offset<&calcProtocol::inResult>() == offsetof(calcProtocol, inResult), "calcProtocol.inResult");
+static_assert(CalcMessage::offset<&calcMessage::message>() == offsetof(calcMessage, message), "calcMessage.message");
+static_assert(CalcMessage::offset<&calcMessage::minor_version>() == offsetof(calcMessage, minor_version), "calcMessage.minor_version");
+
+}
+
+#endif